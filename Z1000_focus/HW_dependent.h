@@ -22,10 +22,63 @@
 
 #include "motor_cancodes.h"
 
-// On lowest speeds Taccelerated = 0.22s, so wait no more than 0.25s when motor starts
-#define TACCEL              (0.50)
-// max amount of cycles when motor stalled
-#define STALL_MAXCTR        (50)
+// stall/slip: motor's or encoder's speed lower than (1-STALL_TOL) of expected by commands
+// and drive's dynamics (less its change in STALL_WINDOW) during STALL_WINDOW seconds
+#define STALL_WINDOW        (0.05)
+#define STALL_TOL           (0.5)
+// motor's current (% of nominal) envelope: its mean over CURRENT_WINDOW seconds at constant
+// speed over CURRENT_DERATE decreases speed by CURRENT_DERATE_K, over CURRENT_STOP stops motion
+#define CURRENT_WINDOW      (0.1)
+#define CURRENT_NSAMPLES    (64)
+#define CURRENT_DERATE      (100.)
+#define CURRENT_DERATE_K    (0.5)
+#define CURRENT_STOP        (150.)
+// stop level is multiplied by CURRENT_ACCEL_K while speed changes (and CURRENT_WINDOW after):
+// inrush current of acceleration is normal
+#define CURRENT_ACCEL_K     (1.5)
+
+// default period of encoder's position PDO (ms)
+#define PDO_PERIOD          (2)
+// streamed position is stale if PDO_MAXLOST periods (but not less than PDO_MINAGE seconds) passed
+#define PDO_MAXLOST         (5)
+#define PDO_MINAGE          (0.02)
+// max time to wait for the first PDO after encoder's start, s
+#define PDO_STARTWAIT       (0.1)
+
+// server's child restarted after CHILD_RESTART_DELAY us if it worked not less
+// than CHILD_MINLIFE seconds, else after 1s
+#define CHILD_MINLIFE       (5.)
+#define CHILD_RESTART_DELAY (20000)
+
+// encoder counts per second for 1 unit of raw motor speed (rough estimate from
+// CORR2 and acceleration time, refine it by `-m` monitoring: Dpos/RAWSPEED(spd))
+#define ENC_CNTS_PER_RAWSPD (0.18)
+// it is refined while moving: max weight of old samples
+#define ENCK_WINDOW         (200)
+
+// max size of encoder's domain object (customer memory) in configuration backup
+#define ENC_CFGMAXLEN       (1024)
+
+// encoder's heartbeat period, ms (0 - use node guarding)
+#define ENC_HEARTBEAT       (100)
+
+// max frequency of SYNC producer, Hz
+#define SYNC_MAXFREQ        (1000.)
+// period of motor's process data exchange when SYNC is off & max age of PI data, s
+#define PDATA_PERIOD        (0.01)
+#define PDATA_MAXAGE        (0.05)
+// PO is repeated while control loop's keepalive isn't older, s
+#define PO_KEEPALIVE        (0.3)
+// period of DI state reading by cyclic thread & max age of DI data, s
+#define SYNC_DI_PERIOD      (0.02)
+#define SYNC_DI_MAXAGE      (0.1)
+// max age of cached values, s: DI state, motor's speed, encoder's position, DI roles
+#define CACHE_DI_MAXAGE     (0.1)
+#define CACHE_SPD_MAXAGE    (0.05)
+#define CACHE_POS_MAXAGE    (0.01)
+#define CACHE_ROLE_MAXAGE   (60.)
+// max amount of SYNC periods without new data
+#define SNAP_MAXLOST        (5)
 
 // direction of motor rotation positive to encoder (1 - negative)
 #define MOTOR_REVERSE       (0)
@@ -47,10 +100,26 @@
 // max/min speed (rev/min)
 #define MAXSPEED            (1550)
 #define MINSPEED            (350)
-// encoder differences (if larger) for speed (MAXSPEED, MAXSPEED/2 and MAXSPEED/3) select
-#define ENCODER_DIFF_SPEED1 (1500)
-#define ENCODER_DIFF_SPEED2 (500)
-#define ENCODER_DIFF_SPEED3 (150)
+// S-curve trajectory: max acceleration (counts/s^2, should be less than drive's
+// deceleration ENC_CNTS_PER_RAWSPD^2/(2*CORR2) ~ 1400) & jerk (counts/s^3)
+#define TRAJ_ACCEL          (1200.)
+#define TRAJ_JERK           (6000.)
+// gain of trajectory position feedback (1/s) & min change of speed setpoint (rev/min)
+#define TRAJ_KP             (2.)
+#define TRAJ_SPDSTEP        (5)
+// speed law: fraction of calibrated deceleration used & max latency of stop command, s
+#define SPEEDLAW_MARGIN     (0.9)
+#define SPEEDLAW_MAXLAT     (0.2)
+// range of drive's deceleration trusted from stopping model (its c2 is poorly excited), counts/s^2
+#define DECEL_MIN           (0.5*TRAJ_ACCEL)
+#define DECEL_MAX           (2.*TRAJ_ACCEL)
+// time of full stop detection (waitTillStop) for move duration prediction, s
+#define MOVE_SETTLE         (0.2)
+// moves needed to trust duration histogram bin & max weight of old moves in it
+#define ETA_MINMOVES        (3)
+#define ETA_WINDOW          (20)
+// amount of points in move benchmark
+#define BENCH_NPOINTS       (5)
 // speed to move from ESW
 #define ESWSPEED            (350)
 // moving timeout: 5minutes
@@ -63,6 +132,13 @@
 #define CORR0               (6.7704)
 #define CORR1               (6.1857e-3)
 #define CORR2               (1.1271e-5)
+// CORR0..CORR2 are initial values of online estimation by each stop (recursive least
+// squares): raw speed scale (thousands), forgetting factor, initial variance of
+// scaled coefficients & max residual (encoder's counts) of accepted stop
+#define CORR_XSCALE         (1000.)
+#define CORR_LAMBDA         (0.98)
+#define CORR_P0             (100.)
+#define CORR_MAXRES         (50.)
 
 
 // constants for focus conversion: foc_mm = (foc_raw - FOCRAW_0) / FOCSCALE_MM
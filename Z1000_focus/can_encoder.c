@@ -19,12 +19,19 @@
 #include "DS406_canopen.h"
 #include "HW_dependent.h"
 #include "can_encoder.h"
+#include "ckpt.h"
+#include "rls.h"
 #include "canopen.h"
 #include "motor_cancodes.h"
+#include "objdict.h"
 #include "socket.h"
+#include "stall.h"
+#include "trajectory.h"
 #include "usefull_macros.h"
 #include <math.h>   // fabs
+#include <pthread.h>
 #include <string.h> // memcpy
+#include <sys/timerfd.h>
 
 // flags: encoder is ready, motor is ready
 static uint8_t encoderRDY = 0, motorRDY = 0;
@@ -32,23 +39,421 @@ static uint8_t encoderRDY = 0, motorRDY = 0;
 // printf when -v
 extern int verbose(const char *fmt, ...);
 
+// duration of startup stages, s
+static struct{
+    double encprobe;    // encoder found: NMT state, reset & device type
+    double encconf;     // PDO stream, alarms & heartbeat configured
+    double encstart;    // encoder is operational
+    double motor;       // motor's parameters read
+    double esw;         // end-switches checked
+} inittimes;
+
 extern bool emerg_stop;
 
 // CAN bus IDs: for motor's functions (PI ID [F=4] == PO ID[F=3] + 1) and parameters
 static unsigned long motor_id = 0, motor_p_id = 0;//, bcast_id = 1;
-// current motor position (RAW)
+// handler of motor's PI and receive queue of parameter answers
+static int motor_piq = -1, motor_parq = -1;
+// motor's process image: PO (control word & speed setpoint) is sent at once and repeated
+// by cyclic thread (SYNC or process data exchange) only while motion is commanded and
+// its control loop calls po_keepalive() (else drive's fieldbus timeout stops it),
+// PI is stored by CAN receive thread
+static struct{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    // signalled on each new PI
+    double period;          // period of cyclic exchange, s (0 - PO is sent only on change)
+    uint8_t po[6];          // last PO
+    int povalid;            // PO was set at least once
+    int moving;             // last PO commands motion
+    double alive;           // time of last keepalive from control loop
+    int estop;              // encoder's emergency: cyclic thread should send stop PO at once
+    int spdmap;             // PI2 is actual speed (checked by check_pimap())
+    int crntmap;            // PI3 is output current
+    uint8_t pi[8];          // last PI: status word, actual speed, current
+    double pitime;          // its receive time
+} pimg = {.mtx = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+// parameter channel is used by cyclic thread too: it holds `parmtx` only to send DI
+// request or collect its answer; the channel is request/response, so other requests
+// are sent only after this answer is got or timed out (param_lock())
+static pthread_mutex_t parmtx = PTHREAD_MUTEX_INITIALIZER;
+static const uint8_t diquery[4] = {CAN_READPAR_CMD, PAR_DI_SUBIDX, PAR_DIST_IDX >> 8, PAR_DIST_IDX & 0xff};
+static struct{
+    int pending;            // answer to DI request isn't received yet (protected by parmtx)
+    double t;               // time of request
+} dipoll;
+// current motor position (RAW) and time of its sampling (receive time of encoder's answer)
 static unsigned long curposition = 0;
+static struct timespec curpostime = {0};
+// values read from devices with their sampling time: callers give max age of value,
+// so redundant requests in one cycle are served from memory
+typedef enum{
+    CACHE_DI,           // DI state (0x208E, read by cyclic thread or on demand)
+    CACHE_SPEED,        // motor's speed (PI2 or 0x207E), rev/min without MOTOR_REVERSE
+    CACHE_CURRENT,      // motor's current (PI3 or 0x2086), % of nominal
+    CACHE_POS,          // encoder's position (0x6004 by PDO or SDO) == curposition
+    CACHE_ROLECW,       // roles of end-switches' DI
+    CACHE_ROLECCW,
+    CACHE_AMOUNT
+} cacheidx;
+static struct{
+    pthread_mutex_t mtx;
+    struct{
+        const char *name;
+        double val;
+        double t;       // sampling time (0 - no value)
+        unsigned long hits, misses;
+    } v[CACHE_AMOUNT];
+} vcache = {.mtx = PTHREAD_MUTEX_INITIALIZER, .v = {
+    [CACHE_DI] = {.name = "DI"}, [CACHE_SPEED] = {.name = "speed"},
+    [CACHE_CURRENT] = {.name = "current"}, [CACHE_POS] = {.name = "position"},
+    [CACHE_ROLECW] = {.name = "CWrole"}, [CACHE_ROLECCW] = {.name = "CCWrole"}}
+};
 // encoder's node number
 static int encnodenum = 0;
+// position & speed streamed by encoder's PDO1/PDO2 (filled by CAN receive thread)
+static struct{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    // signalled on each new position
+    int period;             // PDO period, ms (0 - no streaming, use SDO)
+    int speedon;            // speed is streamed too
+    unsigned long pos;      // last position
+    struct timespec ts;     // its receive time
+    double rtime;           // the same in seconds
+    int16_t speed;          // last speed, encoder counts per second
+    double spdtime;         // its receive time
+} encpdo = {.mtx = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+// data collected by SYNC thread in one cycle
+static struct{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;    // signalled on each new snapshot
+    double freq;            // SYNC frequency, Hz (0 - no SYNC thread)
+    unsigned long n;        // number of snapshot
+    unsigned long missed;   // missed SYNC periods
+    int valid;              // bits of fresh data (SNAP_*)
+    double t;               // time of SYNC
+    unsigned long pos;      // encoder's position
+    struct timespec postime;// and its receive time
+    double encspeed;        // encoder's speed (rev/min, encoder's direction)
+    double motspeed;        // motor's speed from PI (rev/min, without MOTOR_REVERSE)
+    double speed;           // last valid speed (rev/min, without MOTOR_REVERSE)
+    double spdtime;         // its SYNC time
+    uint8_t status[2];      // motor's status word
+} snap = {.mtx = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+#define SNAP_POS        (1<<0)
+#define SNAP_ENCSPEED   (1<<1)
+#define SNAP_PI         (1<<2)
+#define SNAP_MOTSPEED   (1<<3)
+// encoder's alarms: `reread` is set by EMCY handler, `abort` - to stop moving
+static struct{
+    pthread_mutex_t mtx;
+    encalarms a;
+    int reread;
+    int abort;
+} encalrm = {.mtx = PTHREAD_MUTEX_INITIALIZER};
 // system status
 static sysstatus curstatus = STAT_OK;
 // current raw motor speed (without MOTOR_REVERSE)
 static int16_t targspd = 0;
+// target of move2pos() in progress (NAN if none) & motor's address (for state checkpoint)
+static double movetarget = NAN;
+static int motoraddr = -1;
 
 static canstatus can_write_par(uint8_t subidx, uint16_t idx, uint32_t *parval);
 static canstatus can_read_par(uint8_t subidx, uint16_t idx, uint32_t *parval);
-static int move(unsigned long targposition, int16_t rawspeed);
+static int move(unsigned long targposition, int16_t rawspeed, const trajectory *tr);
 static int waitTillStop();
+static void start_sync();
+static int read_alarms();
+static int move2pos_(double target);
+static void save_state();
+static void po_keepalive();
+static void movehist_save(ckptstate *s);
+static void corr_init();
+static void movehist_init();
+
+// round-trip times of motor's process data & parameter channel
+// (parameter writes are slower than reads)
+static rttstat pirtt = RTTSTAT_INIT("PI"), parrtt = RTTSTAT_INIT("param"), parwrtt = RTTSTAT_INIT("param write");
+// stopping distance model (CORR0..CORR2), refined by each stop
+static rlsmodel stopmodel = RLSMODEL_INIT("stopdist");
+static int stopmodel_ok = 0;
+// limit speed by remaining distance (speedlaw()), else follow planned trajectory
+static int speedlaw_on = 0;
+// encoder counts/s per raw speed unit: ENC_CNTS_PER_RAWSPD refined on constant speed
+static double enck = ENC_CNTS_PER_RAWSPD;
+static unsigned long enckn = 0;
+// envelope of motor's current (% of nominal): derate speed or stop
+static double crnt_derate = CURRENT_DERATE, crnt_stop = CURRENT_STOP;
+// motor's current during last move(): rolling window & totals
+static struct{
+    pthread_mutex_t mtx;
+    int n, head;                    // window ring
+    double t[CURRENT_NSAMPLES], i[CURRENT_NSAMPLES];
+    unsigned long nall;             // amount of samples in move
+    double sum2;                    // sum of their squares
+    double peak;                    // max current
+    double mean;                    // last rolling mean
+    double vcap;                    // speed limit after derating, counts/s (0 - none)
+} movecrnt = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+// absolute CLOCK_REALTIME time `tout` seconds later
+static void abstime(struct timespec *ts, double tout){
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += (time_t)tout;
+    ts->tv_nsec += (long)((tout - (time_t)tout) * 1e9);
+    if(ts->tv_nsec >= 1000000000L){
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * @brief cache_getts - get cached value if it isn't older than `maxage`
+ * @param i       - value index
+ * @param maxage  - max age of value, s
+ * @param val (o) - value (may be NULL)
+ * @param t (o)   - its sampling time (may be NULL)
+ * @return 1 if hit
+ */
+static int cache_getts(cacheidx i, double maxage, double *val, double *t){
+    int hit = 0;
+    pthread_mutex_lock(&vcache.mtx);
+    if(vcache.v[i].t > 0. && can_dtime() - vcache.v[i].t < maxage){
+        if(val) *val = vcache.v[i].val;
+        if(t) *t = vcache.v[i].t;
+        ++vcache.v[i].hits;
+        hit = 1;
+    }else ++vcache.v[i].misses;
+    pthread_mutex_unlock(&vcache.mtx);
+    return hit;
+}
+
+// cache_getts() without sampling time
+static int cache_get(cacheidx i, double maxage, double *val){
+    return cache_getts(i, maxage, val, NULL);
+}
+
+/**
+ * @brief cache_put - store value sampled at time `t` (older than cached is ignored)
+ */
+static void cache_put(cacheidx i, double val, double t){
+    pthread_mutex_lock(&vcache.mtx);
+    if(t >= vcache.v[i].t){
+        vcache.v[i].val = val;
+        vcache.v[i].t = t;
+    }
+    pthread_mutex_unlock(&vcache.mtx);
+}
+
+// forget cached value
+static void cache_drop(cacheidx i){
+    pthread_mutex_lock(&vcache.mtx);
+    vcache.v[i].t = 0.;
+    pthread_mutex_unlock(&vcache.mtx);
+}
+
+// set current position & its time (all position readers should call this)
+static void set_curpos(unsigned long pos, const struct timespec *ts){
+    curposition = pos;
+    curpostime = *ts;
+    cache_put(CACHE_POS, (double)pos, can_ts2d(ts));
+}
+
+/**
+ * @brief print_cache - print hits & misses of values cache
+ * @param buf    - output buffer
+ * @param buflen - its length
+ */
+void print_cache(char *buf, int buflen){
+    int l = 0;
+    double now = can_dtime();
+    pthread_mutex_lock(&vcache.mtx);
+    for(int i = 0; i < CACHE_AMOUNT && l < buflen; ++i){
+        double age = vcache.v[i].t > 0. ? (now - vcache.v[i].t)*1e3 : -1.;
+        l += snprintf(buf + l, buflen - l, "%s: hits=%lu misses=%lu age=%.1f value=%g\n", vcache.v[i].name,
+                      vcache.v[i].hits, vcache.v[i].misses, age, vcache.v[i].val);
+    }
+    pthread_mutex_unlock(&vcache.mtx);
+}
+
+/**
+ * @brief motpi_handler - store motor's PI (called by receive thread)
+ * @param fr - received frame
+ */
+static void motpi_handler(const can_rxframe *fr, _U_ void *arg){
+    pthread_mutex_lock(&pimg.mtx);
+    memcpy(pimg.pi, fr->data, 8);
+    pimg.pitime = fr->rtime;
+    pthread_cond_broadcast(&pimg.cond);
+    pthread_mutex_unlock(&pimg.mtx);
+    if(fr->len < 6) return;
+    // PI2 - actual speed (units of PO setpoint), PI3 - current (0.1% In) if drive is set so
+    if(pimg.spdmap) cache_put(CACHE_SPEED, REVMIN((double)(int16_t)((fr->data[2]<<8) | fr->data[3])), fr->rtime);
+    if(pimg.crntmap) cache_put(CACHE_CURRENT, (double)(int16_t)((fr->data[4]<<8) | fr->data[5]) / 10., fr->rtime);
+}
+
+/**
+ * @brief check_pimap - check drive's PI2/PI3 descriptions: values not mapped as
+ *          expected are read by parameter channel
+ */
+static void check_pimap(){
+    uint32_t d2, d3;
+    int spd = (CAN_NOERR == can_read_par(0, PAR_PI2DESC_IDX, &d2) && d2 == PI_SPEED);
+    int crnt = (CAN_NOERR == can_read_par(0, PAR_PI3DESC_IDX, &d3) && d3 == PI_CURRENT);
+    pthread_mutex_lock(&pimg.mtx);
+    pimg.spdmap = spd;
+    pimg.crntmap = crnt;
+    pthread_mutex_unlock(&pimg.mtx);
+    if(!spd) putlog("PI2 isn't actual speed: read speed by parameter channel");
+    if(!crnt) putlog("PI3 isn't output current: read current by parameter channel");
+}
+
+/**
+ * @brief pi_wait - wait for motor's PI received not earlier than `since`
+ * @param since    - time of PO sending
+ * @param tout     - timeout, s
+ * @param data (o) - PI data (6 bytes)
+ * @param rtime (o) - PI receive time (may be NULL)
+ * @return 1 if got PI
+ */
+static int pi_wait(double since, double tout, uint8_t *data, double *rtime){
+    struct timespec ts;
+    abstime(&ts, tout);
+    int ok = 0;
+    pthread_mutex_lock(&pimg.mtx);
+    while(pimg.pitime < since)
+        if(pthread_cond_timedwait(&pimg.cond, &pimg.mtx, &ts)) break;
+    if(pimg.pitime >= since){
+        memcpy(data, pimg.pi, 6);
+        if(rtime) *rtime = pimg.pitime;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&pimg.mtx);
+    return ok;
+}
+
+// max age of PI when cyclic exchange works (at least a few cycles for slow SYNC)
+static double pi_maxage(){
+    return (PDATA_MAXAGE > 3.*pimg.period) ? PDATA_MAXAGE : 3.*pimg.period;
+}
+
+/**
+ * @brief encpdo_handler - store position from encoder's PDO1 (called by receive thread)
+ * @param fr - received frame
+ */
+static void encpdo_handler(const can_rxframe *fr, _U_ void *arg){
+    if(fr->len < 4) return;
+    pthread_mutex_lock(&encpdo.mtx);
+    encpdo.pos = (fr->data[3]<<24)|(fr->data[2]<<16)|(fr->data[1]<<8)|fr->data[0];
+    encpdo.ts = fr->ts;
+    encpdo.rtime = fr->rtime;
+    pthread_cond_broadcast(&encpdo.cond);
+    pthread_mutex_unlock(&encpdo.mtx);
+}
+
+/**
+ * @brief encspeed_handler - store speed from encoder's PDO2 (called by receive thread)
+ * @param fr - received frame
+ */
+static void encspeed_handler(const can_rxframe *fr, _U_ void *arg){
+    if(fr->len < 2) return;
+    pthread_mutex_lock(&encpdo.mtx);
+    encpdo.speed = (int16_t)((fr->data[1]<<8)|fr->data[0]);
+    encpdo.spdtime = fr->rtime;
+    pthread_mutex_unlock(&encpdo.mtx);
+}
+
+// max age of streamed data
+static double encpdo_maxage(){
+    // allow to lose a few PDOs before fallback to SDO
+    double maxage = PDO_MAXLOST * encpdo.period * 1e-3;
+    if(maxage < PDO_MINAGE) maxage = PDO_MINAGE;
+    return maxage;
+}
+
+/**
+ * @brief encpdo_next - wait for position newer than `curpostime` and get it with encoder's speed
+ * @param spd (o) - speed measured by encoder (rev/min of motor, in encoder's direction)
+ * @return 1 if got fresh data
+ */
+static int encpdo_next(double *spd){
+    if(!encpdo.speedon) return 0;
+    double last = can_ts2d(&curpostime), maxage = encpdo_maxage();
+    struct timespec ts;
+    abstime(&ts, maxage);
+    int ok = 0;
+    pthread_mutex_lock(&encpdo.mtx);
+    while(encpdo.rtime <= last)
+        if(pthread_cond_timedwait(&encpdo.cond, &encpdo.mtx, &ts)) break;
+    double now = can_dtime();
+    if(encpdo.rtime > last && now - encpdo.spdtime < maxage){
+        set_curpos(encpdo.pos, &encpdo.ts);
+        *spd = REVMIN((double)encpdo.speed / enck);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&encpdo.mtx);
+    return ok;
+}
+
+/**
+ * @brief encpdo_wait - wait for position PDO received after `since`
+ * @param since - time of NMT start or SYNC
+ * @param tout  - timeout, s
+ * @return 1 if got PDO (`curposition` and `curpostime` are updated)
+ */
+static int encpdo_wait(double since, double tout){
+    struct timespec ts;
+    abstime(&ts, tout);
+    int ok = 0;
+    pthread_mutex_lock(&encpdo.mtx);
+    while(encpdo.rtime < since)
+        if(pthread_cond_timedwait(&encpdo.cond, &encpdo.mtx, &ts)) break;
+    if(encpdo.rtime >= since){
+        set_curpos(encpdo.pos, &encpdo.ts);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&encpdo.mtx);
+    return ok;
+}
+
+/**
+ * @brief encpdo_get - get last streamed position if it's fresh enough
+ * @return 1 if `curposition` and `curpostime` were updated
+ */
+static int encpdo_get(){
+    if(!encpdo.period) return 0;
+    double maxage = encpdo_maxage();
+    int ok = 0;
+    pthread_mutex_lock(&encpdo.mtx);
+    if(can_dtime() - encpdo.rtime < maxage){
+        set_curpos(encpdo.pos, &encpdo.ts);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&encpdo.mtx);
+    return ok;
+}
+
+/**
+ * @brief read_position_ - read encoder's position into `curposition` and stamp it
+ *          (from PDO stream if available, else by SDO) if it is older than `maxage`
+ * @param maxage - max age of `curposition`, s
+ * @return 1 if all OK
+ */
+static int read_position_(double maxage){
+    unsigned long pos;
+    struct timespec ts;
+    if(cache_get(CACHE_POS, maxage, NULL)) return 1; // `curposition` is fresh
+    if(encpdo_get()) return 1;
+    if(!getLong(encnodenum, DS406_POSITION_VAL, 0, &pos)) return 0;
+    SDOrxtime(encnodenum, &ts);
+    set_curpos(pos, &ts);
+    return 1;
+}
+
+// read position newer than CACHE_POS_MAXAGE
+static int read_position(){
+    return read_position_(CACHE_POS_MAXAGE);
+}
 
 // check if end-switches are in default state
 // return 0 if all OK
@@ -56,8 +461,14 @@ static int chk_eswstates(){
     if(!motorRDY) return 0;
     FNAME();
     uint32_t cw, ccw;
-    if(CAN_NOERR != can_read_par(PAR_DI_SUBIDX, PAR_CW_IDX, &cw)) goto verybad;
-    if(CAN_NOERR != can_read_par(PAR_DI_SUBIDX, PAR_CCW_IDX, &ccw)) goto verybad;
+    double t0 = can_dtime(), cval;
+    // roles are changed only by us (cache is updated by can_write_par), so they are read rarely
+    if(cache_get(CACHE_ROLECW, CACHE_ROLE_MAXAGE, &cval)) cw = (uint32_t)cval;
+    else if(CAN_NOERR != can_read_par(PAR_DI_SUBIDX, PAR_CW_IDX, &cw)) goto verybad;
+    else cache_put(CACHE_ROLECW, (double)cw, t0);
+    if(cache_get(CACHE_ROLECCW, CACHE_ROLE_MAXAGE, &cval)) ccw = (uint32_t)cval;
+    else if(CAN_NOERR != can_read_par(PAR_DI_SUBIDX, PAR_CCW_IDX, &ccw)) goto verybad;
+    else cache_put(CACHE_ROLECCW, (double)ccw, t0);
     uint32_t parval = DI_ENSTOP;
     if(cw != DI_ENSTOP || ccw != DI_ENSTOP){ // activate enable/stop
         WARNX("The end-switches state wasn't default!");
@@ -86,6 +497,11 @@ static int chkMove(int spd){
         SINGLEWARN(WARN_MOVEDAMAGED);
         return 1;
     }else clrwarnsingle(WARN_MOVEDAMAGED);
+    if(encoderRDY && read_alarms()){
+        WARNX("Can't move: encoder alarm");
+        curstatus = STAT_ENCERR;
+        return 1;
+    }
     eswstate e;
     if(CAN_NOERR != get_endswitches(&e)){
         curstatus = STAT_ERROR;
@@ -122,15 +538,177 @@ static int chkMove(int spd){
     return 0;
 }
 
+/**
+ * @brief emcy_handler - encoder's emergency message (called by receive thread):
+ *          mark alarms to be reread and abort motion; stop PO is sent by cyclic
+ *          thread on its next cycle (receive thread shouldn't do CAN I/O)
+ * @param fr - received frame
+ */
+static void emcy_handler(const can_rxframe *fr, _U_ void *arg){
+    if(fr->len < 3) return;
+    uint16_t code = fr->data[0] | (fr->data[1] << 8);
+    pthread_mutex_lock(&encalrm.mtx);
+    encalrm.a.emcycode = code;
+    encalrm.a.errreg = fr->data[2];
+    encalrm.a.emcytime = fr->rtime;
+    ++encalrm.a.nemcy;
+    encalrm.reread = 1;
+    pthread_mutex_unlock(&encalrm.mtx);
+    if(code == 0) return; // error reset
+    curstatus = STAT_ENCERR;
+    __atomic_store_n(&encalrm.abort, 1, __ATOMIC_RELEASE);
+    if(targspd && motorRDY) __atomic_store_n(&pimg.estop, 1, __ATOMIC_RELEASE); // don't wait for main thread
+}
+
+/**
+ * @brief read_alarms - read encoder's alarms & warnings
+ * @return 1 if any alarm or emergency is active
+ */
+static int read_alarms(){
+    unsigned short alarms, warnings;
+    int reread;
+    pthread_mutex_lock(&encalrm.mtx);
+    reread = encalrm.reread;
+    encalrm.reread = 0;
+    pthread_mutex_unlock(&encalrm.mtx);
+    if(reread){ // both requests are sent at once
+        sdo_req r[2];
+        sdoGetAsync(&r[0], encnodenum, DS406_ALARMS, 0, NULL, NULL);
+        sdoGetAsync(&r[1], encnodenum, DS406_WARNINGS, 0, NULL, NULL);
+        int ok = sdoWait(&r[0]);
+        ok &= sdoWait(&r[1]);
+        if(!ok){ // keep latched values and try again next time
+            WARNX("Can't read encoder's alarms");
+            pthread_mutex_lock(&encalrm.mtx);
+            encalrm.reread = 1;
+            pthread_mutex_unlock(&encalrm.mtx);
+            return (encalrm.a.alarms || encalrm.a.emcycode);
+        }
+        alarms = sdoValue(&r[0]);
+        warnings = sdoValue(&r[1]);
+        pthread_mutex_lock(&encalrm.mtx);
+        if(alarms != encalrm.a.alarms || warnings != encalrm.a.warnings)
+            putlog("Encoder: alarms=0x%04x, warnings=0x%04x, EMCY=0x%04x", alarms, warnings, encalrm.a.emcycode);
+        encalrm.a.alarms = alarms;
+        encalrm.a.warnings = warnings;
+        pthread_mutex_unlock(&encalrm.mtx);
+    }
+    return (encalrm.a.alarms || encalrm.a.emcycode);
+}
+
+/**
+ * @brief print_rtt - print round-trip times statistics of encoder's SDO & motor
+ * @param buf    - buffer
+ * @param buflen - its length
+ */
+void print_rtt(char *buf, int buflen){
+    int l = rtt_print(sdoRTT(encnodenum), buf, buflen);
+    l += rtt_print(&pirtt, buf + l, buflen - l);
+    l += rtt_print(&parrtt, buf + l, buflen - l);
+    rtt_print(&parwrtt, buf + l, buflen - l);
+}
+
+// get encoder's alarms
+void get_alarms(encalarms *a){
+    if(!a) return;
+    pthread_mutex_lock(&encalrm.mtx);
+    *a = encalrm.a;
+    pthread_mutex_unlock(&encalrm.mtx);
+}
+
+/**
+ * @brief map_pdo - map single object into encoder's TPDO and set its transmission type
+ * @param n   - PDO number (0 - PDO1, 1 - PDO2)
+ * @param obj - mapping value (index<<16 | subindex<<8 | bits)
+ * @param ttype - transmission type (1 - on each SYNC, 0xFE - by timer)
+ * @return 0 if all OK
+ */
+static int map_pdo(int n, unsigned long obj, unsigned char ttype){
+    sdo_req r[2];
+    sdoGetAsync(&r[0], encnodenum, DS406_PDO1_MAPPED + n, 1, NULL, NULL);
+    sdoGetAsync(&r[1], encnodenum, DS406_PDO1_MAPPED + n, 0, NULL, NULL);
+    if(sdoWaitAll(r, 2) != 2 || sdoValue(&r[0]) != obj || sdoValue(&r[1]) != 1){
+        verbose("Map object 0x%04lx into PDO%d\n", obj >> 16, n + 1);
+        if(!setByte(encnodenum, DS406_PDO1_MAPPED + n, 0, 0) ||
+           !setLong(encnodenum, DS406_PDO1_MAPPED + n, 1, obj) ||
+           !setByte(encnodenum, DS406_PDO1_MAPPED + n, 0, 1)){
+            WARNX("Can't map object 0x%04lx into PDO%d", obj >> 16, n + 1);
+            return 1;
+        }
+    }
+    if(!setByte(encnodenum, DS406_PDO1 + n, 2, ttype)){
+        WARNX("Can't set PDO%d transmission type", n + 1);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief pdostream_handlers - register handlers of streamed position & speed
+ * @param period - PDO period, ms
+ * @param speed  - !=0 if speed is streamed too
+ * @return 0 if all OK
+ */
+static int pdostream_handlers(int period, int speed){
+    static int posq = -1, spdq = -1;
+    if(posq < 0) posq = can_rx_handler(0x180 + encnodenum, CAN_RX_EXACT, encpdo_handler, NULL);
+    if(posq < 0) return 1;
+    if(speed && spdq < 0) spdq = can_rx_handler(0x280 + encnodenum, CAN_RX_EXACT, encspeed_handler, NULL);
+    encpdo.period = period;
+    encpdo.speedon = (speed && spdq > -1);
+    return 0;
+}
+
+// register handler of encoder's emergency messages
+static void emcy_register(){
+    static int emcyq = -1;
+    if(emcyq < 0) emcyq = can_rx_handler(0x80 + encnodenum, CAN_RX_EXACT, emcy_handler, NULL);
+}
+
+/**
+ * @brief setup_pdostream - turn on cyclic PDO1 with position and (optionally)
+ *          PDO2 with speed (node should be pre-operational)
+ * @param period - PDO period, ms (0 - send PDOs on each SYNC)
+ * @param speed  - !=0 to stream speed
+ * @return 0 if all OK
+ */
+static int setup_pdostream(int period, int speed){
+    unsigned char ttype = 0xFE; // asynchronous (timer-driven) transmission
+    if(period == 0){ // synchronous
+        if(snap.freq <= 0.) return 1;
+        ttype = 1;
+        period = (int)ceil(1000. / snap.freq);
+    }else if(period < 0 || period > 0xffff){
+        WARNX("Wrong PDO period: %d ms", period);
+        return 1;
+    }
+    if(map_pdo(0, DS406_PDO_IS_POSITION, ttype)) return 1;
+    if(speed && map_pdo(1, DS406_PDO_IS_SPEED, ttype)){
+        WARNX("Encoder speed won't be used");
+        speed = 0;
+    }
+    if(!setShort(encnodenum, DS406_CYCLE_TIMER, 0, (ttype == 1) ? 0 : (unsigned short)period)){
+        WARNX("Can't set PDO cycle timer");
+        return 1;
+    }
+    if(pdostream_handlers(period, speed)) return 1;
+    verbose("Position %sstreaming %s %dms\n", encpdo.speedon ? "& speed " : "",
+            (ttype == 1) ? "on SYNC, max period" : "with period", period);
+    return 0;
+}
+
 /**
  * @brief init_encoder - encoder's interface initialisation
  * @param encnode - encoder's node number
  * @param reset   - reset node before operating
+ * @param pdoperiod - period of position PDO (ms), 0 to read position by SDO
+ * @param encspeed - stream encoder's speed too and use it instead of motor's
  * @return 0 if all OK
  */
-int init_encoder(int encnode, int reset){
+int init_encoder(int encnode, int reset, int pdoperiod, int encspeed){
     FNAME();
-    unsigned long lval;
+    long oval;
+    double t0 = can_dtime();
     encnodenum = encnode;
     verbose("cur node: %d\n", encnodenum);
     if(!initNode(encnodenum)){
@@ -145,9 +723,9 @@ int init_encoder(int encnode, int reset){
         else
             verbose("Failed.\n");
     }
-    if(getLong(encnodenum, DS406_DEVTYPE, 0, &lval)){
-        int prof = lval&0xffff;
-        int type = lval>>16;
+    if(getObject(encnodenum, DS406_DEVTYPE, 0, &oval)){
+        int prof = oval&0xffff;
+        int type = oval>>16;
         verbose("Found absolute %s-turn rotary encoder DS%d\n", (type==2)?"multi":"single", prof);
         if(prof != 406 || type != 2){
             WARNX("The device on node %d isn't a multi-turn encoder!", encnodenum);
@@ -157,10 +735,37 @@ int init_encoder(int encnode, int reset){
         WARNX("Can't get encoder device type");
         return 1;
     }
+    inittimes.encprobe = can_dtime() - t0;
+    t0 = can_dtime();
+    // static objects: read from the bus only once after reset
+    if(getObject(encnodenum, DS406_TURN_RESOLUT, 0, &oval)) verbose("Resolution: %ld counts per turn\n", oval);
+    if(getObject(encnodenum, DS406_SERIAL_NUMBER, 0, &oval)) verbose("Serial number: %ld\n", oval);
+    encpdo.period = 0;
+    encpdo.speedon = 0;
+    if(snap.freq > 0.) pdoperiod = 0; // PDOs are sent on SYNC
+    if((pdoperiod || snap.freq > 0.) && setup_pdostream(pdoperiod, encspeed))
+        WARNX("Can't stream position, will use SDO");
+    emcy_register();
+    encalrm.reread = 1;
+    if(read_alarms()) WARNX("Encoder alarms: 0x%04x", encalrm.a.alarms);
+    if(ENC_HEARTBEAT && !setHeartbeat(encnodenum, ENC_HEARTBEAT))
+        WARNX("Can't turn on heartbeat, will use node guarding");
+    inittimes.encconf = can_dtime() - t0;
+    t0 = can_dtime();
     verbose("Set operational... ");
     startNode(encnodenum);
-    int n, i = recvNextPDO(0.1, &n, &lval);
-    int state = getNodeState(encnodenum);
+    int state;
+    // the first streamed PDO means that node is operational
+    if(encpdo.period){
+        if(snap.freq > 0.) sendSync(); // SYNC producer isn't started yet
+        if(encpdo_wait(t0, PDO_STARTWAIT)){
+            state = NodeOperational;
+            verbose("Got PDO, position=%ld\n", curposition);
+        }else{
+            WARNX("No position PDO after start");
+            state = getNodeState(encnodenum);
+        }
+    }else state = getNodeState(encnodenum);
     verbose("State=%02x\n", state);
     if(state == NodeOperational) verbose("Ok!\n");
     else{
@@ -168,21 +773,10 @@ int init_encoder(int encnode, int reset){
         returnPreOper(-1);
         return 1;
     }
-    if(i > 0) verbose("Node%d PDO%d %08lx\n",n,i,lval);
-    do{
-        int node[4], pdo_n[4];
-        unsigned long pdo_v[4];
-        verbose("Send SYNC...\n");
-        clean_recv();
-        sendSync();
-        can_dsleep(0.01);
-        if((n = recvPDOs(0.5, 4, node, pdo_n, pdo_v))==0)
-            WARNX("No PDO received on SYNC");
-        else for(i=0;i<n;i++)
-            verbose("Node%d PDO%d %08lx (%ld)\n",node[i],pdo_n[i],pdo_v[i],pdo_v[n]);
-    }while(0);
+    inittimes.encstart = can_dtime() - t0;
     curstatus = STAT_OK;
     encoderRDY = 1;
+    start_sync();
     return 0;
 }
 
@@ -246,7 +840,7 @@ int go_out_from_ESW(){
         unsigned long targ = (e == ESW_CW_ACTIVE) ? curposition - (double)FOCSCALE_MM*0.2 : curposition + (double)FOCSCALE_MM*0.2;
         if(targ > FOCMAX) targ = FOCMAX;
         else if(targ < FOCMIN) targ = FOCMIN;
-        if(move(targ, speed)) continue;
+        if(move(targ, speed, NULL)) continue;
         get_endswitches(&e);
         if(e == ESW_INACTIVE) break;
     }
@@ -260,12 +854,11 @@ bad:
 }
 
 /**
- * @brief init_motor_ids - convert motor address into CAN IDs (PO & data)
- *          run this function before any working with motor
- * @param addr - motor driver address
+ * @brief motor_ids - set motor's IDs & create receive queues
+ * @param addr - motor's address
  * @return 0 if all OK
  */
-int init_motor_ids(int addr){
+static int motor_ids(int addr){
     if(addr < 0 || addr > 0x3f){
         WARNX("Wrong motor address, should be from 0 to 63");
         return 1;
@@ -273,12 +866,96 @@ int init_motor_ids(int addr){
     motor_id = MOTOR_PO_ID(addr);
     motor_p_id = MOTOR_PAR_ID(addr);
     DBG("motor POid=%lu, motor_PROCid=%lu", motor_id, motor_p_id);
+    if(!can_ok()) init_can_io();
+    if(motor_piq < 0) motor_piq = can_rx_handler(motor_id+1, CAN_RX_EXACT, motpi_handler, NULL);
+    if(motor_parq < 0) motor_parq = can_rx_queue(motor_p_id+1, CAN_RX_EXACT);
+    if(motor_piq < 0 || motor_parq < 0){
+        WARNX("Can't create receive queues for motor");
+        return 1;
+    }
+    motoraddr = addr;
+    return 0;
+}
+
+/**
+ * @brief motor_setup - set motor's IDs, create receive queues & check end-switches roles
+ * @param addr - motor's address
+ * @return 0 if all OK
+ */
+static int motor_setup(int addr){
+    if(motor_ids(addr)) return 1;
     motorRDY = 1;
+    check_pimap();
+    start_sync();
+    return chk_eswstates();
+}
+
+/**
+ * @brief init_motor_ids - init motor (after encoder) and go out from end-switch if needed
+ * @param addr - motor's address
+ * @return 0 if all OK
+ */
+int init_motor_ids(int addr){
+    if(motor_setup(addr)) return 1;
     // check esw roles & end-switches state
     if(go_out_from_ESW()) return 1;
     return 0;
 }
 
+typedef struct{
+    int node, reset, pdoperiod, encspeed;
+    int ret;
+} encinit_args;
+
+static void *encinit_thread(void *arg){
+    encinit_args *a = (encinit_args*)arg;
+    a->ret = init_encoder(a->node, a->reset, a->pdoperiod, a->encspeed);
+    return NULL;
+}
+
+/**
+ * @brief init_devices - init encoder & motor concurrently, then check end-switches
+ * @param encnode   - encoder's node ID (<0 - don't use encoder)
+ * @param reset     - reset encoder
+ * @param pdoperiod - period of position PDO (ms)
+ * @param encspeed  - stream encoder's speed
+ * @param motaddr   - motor's address (<0 - don't use motor)
+ * @return 0 if all OK, 1 if encoder failed, 2 if motor failed
+ */
+int init_devices(int encnode, int reset, int pdoperiod, int encspeed, int motaddr){
+    double t0 = can_dtime(), t1;
+    pthread_t thread;
+    encinit_args a = {encnode, reset, pdoperiod, encspeed, 0};
+    int ethread = 0, mret = 0;
+    memset(&inittimes, 0, sizeof(inittimes));
+    corr_init();
+    movehist_init();
+    if(!can_ok()) init_can_io(); // before any thread use it
+    if(!can_ok()) return (encnode < 0) ? 2 : 1;
+    if(encnode > -1){
+        if(pthread_create(&thread, NULL, encinit_thread, &a)) encinit_thread(&a);
+        else ethread = 1;
+    }
+    if(motaddr > -1){
+        t1 = can_dtime();
+        mret = motor_setup(motaddr);
+        inittimes.motor = can_dtime() - t1;
+    }
+    if(ethread) pthread_join(thread, NULL);
+    if(encnode > -1 && a.ret) return 1;
+    if(mret) return 2;
+    t1 = can_dtime();
+    if(go_out_from_ESW()) return 2;
+    inittimes.esw = can_dtime() - t1;
+    t1 = can_dtime() - t0;
+    verbose("Startup times (ms): encoder probe %.1f, config %.1f, start %.1f; motor %.1f; ESW %.1f; total %.1f\n",
+            inittimes.encprobe*1e3, inittimes.encconf*1e3, inittimes.encstart*1e3, inittimes.motor*1e3,
+            inittimes.esw*1e3, t1*1e3);
+    putlog("Startup %.1fms (encoder: %.1f/%.1f/%.1f, motor: %.1f, ESW: %.1f)", t1*1e3, inittimes.encprobe*1e3,
+           inittimes.encconf*1e3, inittimes.encstart*1e3, inittimes.motor*1e3, inittimes.esw*1e3);
+    return 0;
+}
+
 /**
  * @brief getPos - get current encoder's position
  * @param pos (o) - position value (in mm)
@@ -287,7 +964,12 @@ int init_motor_ids(int addr){
 int getPos(double *pos){
     //FNAME();
     if(!encoderRDY) return 1;
-    int r = !(getLong(encnodenum, DS406_POSITION_VAL, 0, &curposition));
+    if(heartbeatLost(encnodenum)){
+        SINGLEWARN(WARN_HBLOST);
+        curstatus = STAT_ERROR;
+        return 1;
+    }else clrwarnsingle(WARN_HBLOST);
+    int r = !read_position();
     double posmm = FOC_RAW2MM(curposition);
     if(pos) *pos = posmm;
     verbose("Raw position: %ld\nposition in mm: %.2f\n", curposition, posmm);
@@ -315,8 +997,10 @@ int getPos(double *pos){
         default:
             curstatus = STAT_OK;
     }
+    if(read_alarms() && curstatus != STAT_DAMAGE) curstatus = STAT_ENCERR;
     //DBG("targspd = %d", targspd);
     if(targspd){
+        po_keepalive(); // constant speed motion is supervised here
         if(posmm <= FOCMIN_MM && targspd < 0){ // bad value
             SINGLEWARN(WARN_LESSMIN);
             stop();
@@ -338,6 +1022,7 @@ int getPos(double *pos){
             //WARNX("Current position >= FOCMAX");
         }
     }
+    save_state();
     return r;
 }
 
@@ -346,6 +1031,11 @@ double curPos(){
     return FOC_RAW2MM(curposition);
 }
 
+// time when curposition was sampled (UNIX time, s)
+double curPosTime(){
+    return can_ts2d(&curpostime);
+}
+
 /**
  * @brief returnPreOper - return encoder into pre-operational state
  * @arg presetval - new preset value (if > -1)
@@ -362,6 +1052,8 @@ void returnPreOper(long long presetval){
     }
     verbose("Ok!\n");
     encoderRDY = 0;
+    encpdo.period = 0;
+    encpdo.speedon = 0;
     if(presetval < 0) return;
     green("Try to change preset value to %lld", presetval);
     printf("\n");
@@ -391,6 +1083,109 @@ void returnPreOper(long long presetval){
     }
 }
 
+// objects which aren't backed up: commands, safety configuration (see returnPreOper) & bus settings
+static int cfg_skip(const odobject *o){
+    if(o->access != OD_RW) return 1;
+    switch(o->idx){
+        case DS406_STORE_PARAMS:
+        case DS406_RESTORE_DEF:
+        case DS406_BAUDRATE:
+        case DS406_NODE_NUMBER:
+            return 1;
+        default:
+            break;
+    }
+    return (o->idx >= DS406_CONF_PARAMETERS && o->idx <= DS406_CONF_CHECKSUM);
+}
+
+/**
+ * @brief enc_cfgsave - backup encoder's writeable objects (known by dictionary) into file;
+ *          each line is "index subindex hexdata"
+ * @param name - file name
+ * @return 0 if all OK
+ */
+int enc_cfgsave(const char *name){
+    if(!encoderRDY) return 1;
+    FILE *f = fopen(name, "w");
+    if(!f){
+        WARN("Can't open %s", name);
+        return 1;
+    }
+    unsigned char buf[ENC_CFGMAXLEN];
+    const odobject *o;
+    int nobj = 0, nbad = 0;
+    double t0 = can_dtime();
+    for(int i = 0; (o = od_get(i)); ++i){
+        if(cfg_skip(o)) continue;
+        int len, sz = od_size(o);
+        if(sz) len = sdoUpload(encnodenum, o->idx, o->subidx, buf, sz);
+        else if((len = sdoBlockUpload(encnodenum, o->idx, o->subidx, buf, ENC_CFGMAXLEN)) < 0) // domain: by block if supported
+            len = sdoUpload(encnodenum, o->idx, o->subidx, buf, ENC_CFGMAXLEN);
+        if(len < 0){
+            WARNX("Can't read object 0x%04X/%d", o->idx, o->subidx);
+            ++nbad;
+            continue;
+        }
+        if(len == 0) continue;
+        fprintf(f, "%04X %d ", o->idx, o->subidx);
+        for(int j = 0; j < len; ++j) fprintf(f, "%02X", buf[j]);
+        fprintf(f, "\n");
+        ++nobj;
+    }
+    fclose(f);
+    verbose("Saved %d objects to %s in %.3fs\n", nobj, name, can_dtime() - t0);
+    return (nbad != 0);
+}
+
+/**
+ * @brief enc_cfgload - restore encoder's objects from file made by enc_cfgsave() and store them
+ *          in encoder's non-volatile memory
+ * @param name - file name
+ * @return 0 if all OK
+ */
+int enc_cfgload(const char *name){
+    if(!encoderRDY) return 1;
+    FILE *f = fopen(name, "r");
+    if(!f){
+        WARN("Can't open %s", name);
+        return 1;
+    }
+    char line[2*ENC_CFGMAXLEN + 32];
+    unsigned char buf[ENC_CFGMAXLEN];
+    int nobj = 0, nbad = 0;
+    double t0 = can_dtime();
+    setPreOper(encnodenum); // PDO parameters could be changed only in pre-operational state
+    while(fgets(line, sizeof(line), f)){
+        unsigned int idx, subidx, b;
+        int pos = 0, len = 0;
+        if(sscanf(line, "%x %u %n", &idx, &subidx, &pos) < 2 || pos == 0) continue;
+        const odobject *o = od_find(idx, subidx);
+        if(!o || cfg_skip(o)){
+            WARNX("Object 0x%04X/%u can't be restored", idx, subidx);
+            ++nbad;
+            continue;
+        }
+        for(char *s = line + pos; len < ENC_CFGMAXLEN && sscanf(s, "%2x", &b) == 1; s += 2) buf[len++] = b;
+        if(len < 1) continue;
+        // long objects by block if supported
+        int ok = (len > 4 && sdoBlockDownload(encnodenum, idx, subidx, buf, len)) ||
+                 sdoDownload(encnodenum, idx, subidx, buf, len);
+        if(!ok){
+            WARNX("Can't write object 0x%04X/%u", idx, subidx);
+            ++nbad;
+        }else ++nobj;
+    }
+    fclose(f);
+    if(nobj && !saveObjects(encnodenum)){
+        WARNX("Can't store parameters");
+        ++nbad;
+    }
+    od_invalidate(encnodenum);
+    startNode(encnodenum);
+    verbose("Restored %d objects from %s in %.3fs\n", nobj, name, can_dtime() - t0);
+    return (nbad != 0);
+}
+
 /**
  * @brief fix_targspeed - fix speed value if it is greater MAXSPEED or less than MINSPEED
  * @param targspd (io) - target speed in rev/min
@@ -406,7 +1201,9 @@ static void fix_targspeed(int16_t *targspd){
 }
 
 /**
- * @brief can_send_chk - send CAN frame to motor & check answer
+ * @brief can_send_chk - send PO at once (it is stored in process image too) & check
+ *          motor's state: while cyclic exchange works state is taken from last PI,
+ *          else answer is waited
  * @param buf (i)  - PO data frame (6 bytes)
  * @param obuf (o) - received PI data frame
  * @return status
@@ -420,30 +1217,31 @@ static canstatus can_send_chk(unsigned char *buf, unsigned char *obuf){
             printf(" %02x", buf[i]);
         printf("\n");
     }*/
+    unsigned char rdata[8];
+    double trcv;
+    pthread_mutex_lock(&pimg.mtx);
+    memcpy(pimg.po, buf, l);
+    pimg.povalid = 1;
+    pimg.moving = (buf[2] || buf[3]);
+    double t0 = can_dtime();
+    pimg.alive = t0;
     if(can_send_frame(motor_id, l, buf) <= 0){
+        pthread_mutex_unlock(&pimg.mtx);
         SINGLEWARN(WARN_CANSEND);
         return CAN_CANTSEND;
     }else clrwarnsingle(WARN_CANSEND);
-    int I, rxpnt, dlen;
-    canid_t idr;
-    double rxtime;
-    unsigned char rdata[8];
-    can_clean_recv(&rxpnt, &rxtime);
-    for(I = 0; I < 50; ++I){
-        if(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata) && (idr&0x1fffffff) == motor_id+1) break;
-        can_dsleep(0.01);
-    }
-    if(I == 50){
-        SINGLEWARN(WARN_CANNOANS);
-        return CAN_NOANSWER;
-    }else clrwarnsingle(WARN_CANNOANS);
+    int fresh = (pimg.period > 0. && t0 - pimg.pitime < pi_maxage());
+    if(fresh) memcpy(rdata, pimg.pi, l);
+    pthread_mutex_unlock(&pimg.mtx);
+    if(!fresh){
+        if(!pi_wait(t0, rtt_tout(&pirtt, 0.5), rdata, &trcv)){
+            rtt_lost(&pirtt);
+            SINGLEWARN(WARN_CANNOANS);
+            return CAN_NOANSWER;
+        }else clrwarnsingle(WARN_CANNOANS);
+        rtt_add(&pirtt, trcv - t0);
+    }
     if(obuf) memcpy(obuf, rdata, l);
-    /*if(G->verbose){
-        printf("Got answer with ID=%d: ", idr&0x1fffffff);
-        for(int i = 0; i < dlen; ++i)
-            printf(" %02x", rdata[i]);
-        printf("\n");
-    }*/
     if((rdata[0] & (SW_B_MAILFUN|SW_B_READY)) == SW_B_MAILFUN){ // error
         WARNX("Mailfunction, error code: %d", rdata[1]);
         return CAN_ERROR; // error
@@ -457,55 +1255,117 @@ static canstatus can_send_chk(unsigned char *buf, unsigned char *obuf){
     return 0;
 }
 
+// confirm that motion is supervised: PO would be repeated by cyclic thread for PO_KEEPALIVE
+static void po_keepalive(){
+    pthread_mutex_lock(&pimg.mtx);
+    pimg.alive = can_dtime();
+    pthread_mutex_unlock(&pimg.mtx);
+}
+
 /**
- * @brief can_send_parag - send/get motor parameters
+ * @brief param_send - send motor parameter request
  * @param buf (i)  - parameter out data frame (8 bytes)
- * @param obuf (o) - parameter in data frame (8 bytes)
+ * @param t0 (o)   - time of sending (older answers are stale)
  * @return status
  */
-static canstatus can_send_param(unsigned char *buf, unsigned char *obuf){
+static canstatus param_send(unsigned char *buf, double *t0){
     if(!motorRDY) return CAN_NOANSWER;
     const int l = 8; // frame length
-    int I, rxpnt, dlen;
-    canid_t idr;
-    double rxtime;
-    unsigned char rdata[8];
 /*
 green("Sent param:     ");
 for(int i=0; i<l; ++i) printf("0x%02x ", buf[i]);
 printf("\n");
 */
+    *t0 = can_dtime();
     if(can_send_frame(motor_p_id, l, buf) <= 0){
         SINGLEWARN(WARN_CANSEND);
         return CAN_CANTSEND;
     } else clrwarnsingle(WARN_CANSEND);
-    can_clean_recv(&rxpnt, &rxtime);
-    for(I = 0; I < 50; ++I){
-        if(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata) && (idr&0x1fffffff) == motor_p_id+1) break;
-        //DBG("Got frame from ID 0x%x, need: 0x%x", idr&0x1fffffff, motor_p_id+1);
-        can_dsleep(0.01);
-    }
-    if(I == 50){
-        SINGLEWARN(WARN_SENDPAR);
-        return CAN_NOANSWER;
-    }else clrwarnsingle(WARN_SENDPAR);
+    return CAN_NOERR;
+}
+
+// `a` is answer to request `q`: the same command (besides error flag), index & subindex
+static int param_match(const uint8_t *q, const uint8_t *a){
+    return ((a[0] & ~CAN_PAR_ERRFLAG) == q[0] && a[1] == q[1] && a[2] == q[2] && a[3] == q[3]);
+}
+
+/**
+ * @brief di_collect - take answer to DI request of cyclic thread (call with parmtx locked);
+ *          request is forgotten if it isn't answered in SYNC_DI_MAXAGE
+ * @param wait - !=0 to wait for answer or its timeout, else only check queue
+ */
+static void di_collect(int wait){
+    can_rxframe fr;
+    while(dipoll.pending){
+        double tout = wait ? dipoll.t + SYNC_DI_MAXAGE - can_dtime() : 0.;
+        if(!can_rx_wait_since(motor_parq, dipoll.t, (tout > 0.) ? tout : 0., &fr)){
+            if(can_dtime() - dipoll.t > SYNC_DI_MAXAGE) dipoll.pending = 0;
+            return;
+        }
+        if(!param_match(diquery, fr.data)) continue; // late answer to other request
+        if(!(fr.data[0] & CAN_PAR_ERRFLAG))
+            cache_put(CACHE_DI, (double)(fr.data[4]<<24 | fr.data[5]<<16 | fr.data[6]<<8 | fr.data[7]), dipoll.t);
+        dipoll.pending = 0;
+    }
+}
+
+// lock parameter channel: wait till DI request of cyclic thread is finished
+static void param_lock(){
+    pthread_mutex_lock(&parmtx);
+    di_collect(1);
+}
+
+/**
+ * @brief param_recv - wait for answer to parameter request sent @ t0; late answers
+ *          to previous requests are skipped
+ * @param buf (i)  - parameter out data frame (8 bytes)
+ * @param obuf (o) - parameter in data frame (8 bytes)
+ * @param t0       - time of request sending
+ * @return status
+ */
+static canstatus param_recv(unsigned char *buf, unsigned char *obuf, double t0){
+    can_rxframe fr;
+    rttstat *rtt = (buf[0] == CAN_WRITEPAR_CMD) ? &parwrtt : &parrtt;
+    double tend = t0 + rtt_tout(rtt, 0.5);
+    while(1){
+        double tout = tend - can_dtime();
+        if(tout <= 0. || !can_rx_wait_since(motor_parq, t0, tout, &fr)){
+            rtt_lost(rtt);
+            SINGLEWARN(WARN_SENDPAR);
+            return CAN_NOANSWER;
+        }else clrwarnsingle(WARN_SENDPAR);
+        if(param_match(buf, fr.data)) break;
+        DBG("Skip late parameter answer");
+    }
+    rtt_add(rtt, fr.rtime - t0);
 /*
 green("Received param: ");
-for(int i=0; i<dlen; ++i) printf("0x%02x ", rdata[i]);
+for(int i=0; i<fr.len; ++i) printf("0x%02x ", fr.data[i]);
 printf("\n");
 */
-    if(obuf) memcpy(obuf, rdata, dlen);
-    if(obuf[0] & CAN_PAR_ERRFLAG){
+    if(obuf) memcpy(obuf, fr.data, fr.len);
+    if(fr.data[0] & CAN_PAR_ERRFLAG){
         WARNX("Wrong parameter idx/subidx or other error");
         return CAN_WARNING;
     }
-    if(*((uint32_t*)buf) != *((uint32_t*)obuf)){
-        WARNX("Got wrong answer for parameter request");
-        return CAN_WARNING;
-    }
     return CAN_NOERR;
 }
 
+/**
+ * @brief can_send_param - send/get motor parameters
+ * @param buf (i)  - parameter out data frame (8 bytes)
+ * @param obuf (o) - parameter in data frame (8 bytes)
+ * @return status
+ */
+static canstatus can_send_param(unsigned char *buf, unsigned char *obuf){
+    double t0;
+    param_lock();
+    canstatus s = param_send(buf, &t0);
+    if(s == CAN_NOERR) s = param_recv(buf, obuf, t0);
+    pthread_mutex_unlock(&parmtx);
+    return s;
+}
+
 /**
  * @brief can_read_par - read motor parameter
  * @param subidx     - parameter subindex
@@ -545,31 +1405,318 @@ static canstatus can_write_par(uint8_t subidx, uint16_t idx, uint32_t *parval){
         buf[6] = (par >> 8)  & 0xff;
         buf[7] = par & 0xff;
     }
-    return can_send_param(buf, obuf);
+    double t0 = can_dtime();
+    canstatus s = can_send_param(buf, obuf);
+    if(subidx == PAR_DI_SUBIDX && (idx == PAR_CW_IDX || idx == PAR_CCW_IDX)){ // cached DI role changed
+        cacheidx i = (idx == PAR_CW_IDX) ? CACHE_ROLECW : CACHE_ROLECCW;
+        if(s == CAN_NOERR) cache_put(i, parval ? (double)*parval : 0., t0);
+        else cache_drop(i); // unknown state
+    }
+    return s;
 }
 
 /**
- * @brief get_motor_speed
- * @param motstatus (o) - status (if !NULL)
- * @return speed in rev/min
+ * @brief get_motor_speed - get actual speed from cache (PI) or by parameter channel
+ * @param spd (o) - speed in rev/min
+ * @return status
  */
 canstatus get_motor_speed(double *spd){
     if(!motorRDY) return CAN_NOANSWER;
     if(!spd) return CAN_WARNING;
+    if(cache_get(CACHE_SPEED, CACHE_SPD_MAXAGE, spd)) return CAN_NOERR;
     union{
         uint32_t u;
         int32_t i;
     } speed;
+    double t0 = can_dtime();
     canstatus s = can_read_par(PAR_SPD_SUBIDX, PAR_SPD_IDX, &speed.u);
     if(s != CAN_NOERR){
         return s;
     }
     *spd = (double)speed.i / 1000.;
+    cache_put(CACHE_SPEED, *spd, t0);
     return CAN_NOERR;
 }
 
 /**
- * @brief get_endswitches - get state of end-switches
+ * @brief get_motor_current - get actual current from cache (PI) or by parameter channel
+ * @param crnt (o) - current, % of nominal
+ * @return status
+ */
+canstatus get_motor_current(double *crnt){
+    if(!motorRDY) return CAN_NOANSWER;
+    if(!crnt) return CAN_WARNING;
+    if(cache_get(CACHE_CURRENT, CACHE_SPD_MAXAGE, crnt)) return CAN_NOERR;
+    union{
+        uint32_t u;
+        int32_t i;
+    } c;
+    double t0 = can_dtime();
+    canstatus s = can_read_par(PAR_CRNT_SUBIDX, PAR_CRNT_IDX, &c.u);
+    if(s != CAN_NOERR){
+        return s;
+    }
+    *crnt = (double)c.i / 1000.;
+    cache_put(CACHE_CURRENT, *crnt, t0);
+    return CAN_NOERR;
+}
+
+/**
+ * @brief read_pos_speed - read encoder position & motor speed; both requests
+ *          are sent by one syscall and both answers are waited simultaneously
+ *          (if position is streamed by PDO, only speed is requested; if speed is
+ *          streamed too, wait for the next PDO without any requests; fresh speed
+ *          from cache isn't requested too)
+ * @param pos (o) - raw position (also stored in curposition with its timestamp)
+ * @param spd (o) - motor speed (rev/min, without MOTOR_REVERSE)
+ * @return 0 if all OK, bit 0 set if can't get position, bit 1 - can't get speed
+ */
+static int read_pos_speed(unsigned long *pos, double *spd){
+    uint8_t buf[8] = {CAN_READPAR_CMD, PAR_SPD_SUBIDX, PAR_SPD_IDX >> 8, PAR_SPD_IDX & 0xff}, obuf[8];
+    unsigned char data[4];
+    double t0;
+    int ret = 0;
+    if(encpdo_next(spd)){ // all data streamed
+        if(MOTOR_REVERSE) *spd = -*spd;
+        if(pos) *pos = curposition;
+        return 0;
+    }
+    int pifresh = cache_get(CACHE_SPEED, CACHE_SPD_MAXAGE, spd);
+    canstatus s = CAN_NOERR;
+    if(!pifresh) param_lock();
+    can_tx_begin();
+    if(!pifresh) s = param_send(buf, &t0);
+    // don't ask position by SDO if it is streamed
+    int streamed = (encpdo.period != 0);
+    int sdook = streamed ? 0 : sendSDOreq(encnodenum, DS406_POSITION_VAL, 0);
+    can_tx_flush();
+    if(!pifresh){
+        if(s == CAN_NOERR) s = param_recv(buf, obuf, t0);
+        pthread_mutex_unlock(&parmtx);
+        if(s == CAN_NOERR){
+            int32_t speed = (int32_t)(obuf[4]<<24 | obuf[5]<<16 | obuf[6]<<8 | obuf[7]);
+            *spd = (double)speed / 1000.;
+            cache_put(CACHE_SPEED, *spd, t0);
+        }else ret |= 2;
+    }
+    if(streamed){
+        if(!read_position()) ret |= 1;
+        else if(pos) *pos = curposition;
+    }else if(sdook && recvSDOresp(encnodenum, 0x40, DS406_POSITION_VAL, 0, data) == 4){
+        struct timespec ts;
+        SDOrxtime(encnodenum, &ts);
+        set_curpos((data[3]<<24)|(data[2]<<16)|(data[1]<<8)|data[0], &ts);
+        if(pos) *pos = curposition;
+    }else ret |= 1;
+    return ret;
+}
+
+/**
+ * @brief sync_collect - put answers to previous SYNC (sent @ `tsync`) into snapshot
+ * @param tsync - time of previous SYNC
+ * @param pisent - PO was sent with previous SYNC
+ */
+static void sync_collect(double tsync, int pisent){
+    int valid = 0;
+    unsigned long pos = 0;
+    struct timespec postime = {0};
+    double encspeed = 0., motspeed = 0.;
+    uint8_t status[2] = {0};
+    pthread_mutex_lock(&encpdo.mtx);
+    if(encpdo.rtime >= tsync){
+        pos = encpdo.pos;
+        postime = encpdo.ts;
+        valid |= SNAP_POS;
+    }
+    if(encpdo.speedon && encpdo.spdtime >= tsync){
+        encspeed = REVMIN((double)encpdo.speed / enck);
+        valid |= SNAP_ENCSPEED;
+    }
+    pthread_mutex_unlock(&encpdo.mtx);
+    pthread_mutex_lock(&pimg.mtx);
+    if(pisent && pimg.pitime >= tsync){
+        status[0] = pimg.pi[0];
+        status[1] = pimg.pi[1];
+        valid |= SNAP_PI;
+        // PI2 is actual speed, the same units as PO setpoint
+        if(pimg.spdmap){
+            motspeed = REVMIN((double)(int16_t)((pimg.pi[2]<<8) | pimg.pi[3]));
+            valid |= SNAP_MOTSPEED;
+        }
+    }
+    pthread_mutex_unlock(&pimg.mtx);
+    pthread_mutex_lock(&snap.mtx);
+    snap.t = tsync;
+    snap.valid = valid;
+    if(valid & SNAP_POS){
+        snap.pos = pos;
+        snap.postime = postime;
+    }
+    if(valid & SNAP_ENCSPEED) snap.encspeed = encspeed;
+    if(valid & SNAP_PI) memcpy(snap.status, status, 2);
+    if(valid & SNAP_MOTSPEED) snap.motspeed = motspeed;
+    // encoder's speed is preferable as measured at load side
+    if(valid & (SNAP_ENCSPEED | SNAP_MOTSPEED)){
+        if(valid & SNAP_ENCSPEED) snap.speed = MOTOR_REVERSE ? -encspeed : encspeed;
+        else snap.speed = motspeed;
+        snap.spdtime = tsync;
+    }
+    ++snap.n;
+    pthread_cond_broadcast(&snap.cond);
+    pthread_mutex_unlock(&snap.mtx);
+}
+
+/**
+ * @brief cycle_thread - cyclic exchange by timer with absolute deadlines: send SYNC
+ *          (if enabled), motor's PO from process image (while motion is commanded &
+ *          supervised) and DI request; answers
+ *          to SYNC are collected at the beginning of next cycle
+ */
+static void *cycle_thread(_U_ void *arg){
+    uint8_t dibuf[8];
+    double tsync = 0.;
+    int pisent = 0, syncon = (snap.freq > 0.);
+    memset(dibuf, 0, 8);
+    memcpy(dibuf, diquery, 4);
+    struct sched_param sp = {.sched_priority = 10};
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp); // try to decrease jitter
+    int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if(fd < 0){
+        WARN("timerfd_create()");
+        snap.freq = pimg.period = 0.;
+        return NULL;
+    }
+    long period = syncon ? (long)(1e9 / snap.freq) : (long)(PDATA_PERIOD * 1e9);
+    struct itimerspec its = {.it_interval = {period / 1000000000L, period % 1000000000L}};
+    clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+    its.it_value.tv_nsec += period;
+    its.it_value.tv_sec += its.it_value.tv_nsec / 1000000000L;
+    its.it_value.tv_nsec %= 1000000000L;
+    if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL)){
+        WARN("timerfd_settime()");
+        close(fd);
+        snap.freq = pimg.period = 0.;
+        return NULL;
+    }
+    pimg.period = period * 1e-9;
+    while(1){
+        uint64_t nexp;
+        if(read(fd, &nexp, sizeof(nexp)) != sizeof(nexp)){
+            if(errno == EINTR) continue;
+            WARN("read(timerfd)");
+            break;
+        }
+        if(nexp > 1) snap.missed += nexp - 1;
+        if(syncon && tsync > 0.) sync_collect(tsync, pisent);
+        // parameter channel is busy: its user waits for DI answer before own request
+        int parlocked = motorRDY && !pthread_mutex_trylock(&parmtx);
+        if(parlocked) di_collect(0); // DI answer could come in any of next cycles
+        int askdi = parlocked && !dipoll.pending && can_dtime() - dipoll.t > SYNC_DI_PERIOD;
+        pthread_mutex_lock(&pimg.mtx);
+        can_tx_begin();
+        tsync = can_dtime();
+        if(syncon && encoderRDY) sendSync();
+        if(motorRDY && __atomic_exchange_n(&pimg.estop, 0, __ATOMIC_ACQ_REL)){ // encoder's emergency
+            uint8_t stopbuf[6] = {0, CW_STOP, 0,};
+            memcpy(pimg.po, stopbuf, 6);
+            pimg.povalid = 1;
+            pimg.moving = 0;
+            can_send_frame(motor_id, 6, pimg.po);
+        }
+        pisent = (motorRDY && pimg.povalid && pimg.moving && tsync - pimg.alive < PO_KEEPALIVE);
+        if(pisent) can_send_frame(motor_id, 6, pimg.po);
+        if(askdi && CAN_NOERR == param_send(dibuf, &dipoll.t)) dipoll.pending = 1;
+        can_tx_flush();
+        pthread_mutex_unlock(&pimg.mtx);
+        if(parlocked) pthread_mutex_unlock(&parmtx);
+    }
+    close(fd);
+    snap.freq = pimg.period = 0.;
+    return NULL;
+}
+
+// start cyclic thread if SYNC is enabled or motor is ready and it is not started yet
+static void start_sync(){
+    static pthread_t thread;
+    static int started = 0;
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER; // encoder & motor are initialized concurrently
+    pthread_mutex_lock(&mtx);
+    if(!started && (snap.freq > 0. || motorRDY)){
+        if(pthread_create(&thread, NULL, cycle_thread, NULL)){
+            WARN("pthread_create()");
+            snap.freq = 0.;
+        }else{
+            started = 1;
+            if(snap.freq > 0.) verbose("SYNC producer started with frequency %gHz\n", snap.freq);
+            else verbose("Process data exchange started with period %gms\n", PDATA_PERIOD*1e3);
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * @brief set_sync - set frequency of SYNC producer (call before init_encoder/init_motor_ids)
+ * @param freq - frequency, Hz (0 - don't produce SYNC)
+ * @return 0 if all OK
+ */
+int set_sync(double freq){
+    if(freq < 0. || freq > SYNC_MAXFREQ){
+        WARNX("SYNC frequency should be from 0 to %g", SYNC_MAXFREQ);
+        return 1;
+    }
+    snap.freq = freq;
+    return 0;
+}
+
+/**
+ * @brief set_curlimits - set envelope of motor's current while moving
+ * @param derate - mean current to decrease speed, % of nominal
+ * @param stop   - mean current to stop motion, % of nominal
+ * @return 0 if all OK
+ */
+int set_curlimits(double derate, double stop){
+    if(derate <= 0. || stop <= 0. || derate > stop){
+        WARNX("Current limits should be positive, derating limit not greater than stopping one");
+        return 1;
+    }
+    crnt_derate = derate;
+    crnt_stop = stop;
+    return 0;
+}
+
+/**
+ * @brief snap_next - wait for next SYNC snapshot newer than `*lastn`, put its
+ *          position into `curposition`
+ * @param lastn (io) - number of last snapshot used
+ * @param spd (o)    - last speed (rev/min, without MOTOR_REVERSE): encoder's or motor's
+ * @return like read_pos_speed: bit 0 - no position, bit 1 - no speed
+ */
+static int snap_next(unsigned long *lastn, double *spd){
+    struct timespec ts;
+    int ret = 0;
+    abstime(&ts, SNAP_MAXLOST / snap.freq);
+    pthread_mutex_lock(&snap.mtx);
+    while(snap.n == *lastn)
+        if(pthread_cond_timedwait(&snap.cond, &snap.mtx, &ts)) break;
+    if(snap.n == *lastn){
+        pthread_mutex_unlock(&snap.mtx);
+        return 3;
+    }
+    *lastn = snap.n;
+    if(snap.valid & SNAP_POS){
+        set_curpos(snap.pos, &snap.postime);
+    }else ret |= 1;
+    // speed could be lost in a few cycles
+    if(snap.t - snap.spdtime < SNAP_MAXLOST / snap.freq) *spd = snap.speed;
+    else ret |= 2;
+    pthread_mutex_unlock(&snap.mtx);
+    // speed isn't in PI: read it by parameter channel
+    if((ret & 2) && !pimg.spdmap && CAN_NOERR == get_motor_speed(spd)) ret &= ~2;
+    return ret;
+}
+
+/**
+ * @brief get_endswitches - get state of end-switches (DI state not older than CACHE_DI_MAXAGE)
  * @param Esw (o) - end-switches state
  * @return
  */
@@ -577,7 +1724,12 @@ canstatus get_endswitches(eswstate *Esw){
     if(!motorRDY) return CAN_NOANSWER;
     //FNAME();
     uint32_t val = 0;
-    canstatus s = can_read_par(PAR_DI_SUBIDX, PAR_DIST_IDX, &val);
+    canstatus s = CAN_NOERR;
+    double cval, t0 = can_dtime();
+    // DI state is read by cyclic thread or by previous call
+    if(cache_get(CACHE_DI, CACHE_DI_MAXAGE, &cval)) val = (uint32_t)cval;
+    else if(CAN_NOERR == (s = can_read_par(PAR_DI_SUBIDX, PAR_DIST_IDX, &val)))
+        cache_put(CACHE_DI, (double)val, t0);
     if(s != CAN_NOERR){
         SINGLEWARN(WARN_ESWSTATE);
         return s;
@@ -608,6 +1760,7 @@ int stop(){
         return 1;
     }
     targspd = 0;
+    save_state();
     return 0;
 }
 
@@ -640,7 +1793,7 @@ static int waitTillStop(){
             oldposition = curposition;
             // now wait for full moving stop
             if(!encoderRDY) break;
-            getLong(encnodenum, DS406_POSITION_VAL, 0, &curposition);
+            read_position();
             //DBG("curpos: %lu, oldpos: %ld", curposition, oldposition);
         }while((long)curposition != oldposition);
     }else{
@@ -650,6 +1803,107 @@ static int waitTillStop(){
     return 0;
 }
 
+// fill checkpoint by current state
+static void fill_state(ckptstate *s){
+    s->encnode = encoderRDY ? encnodenum : -1;
+    s->motaddr = motorRDY ? motoraddr : -1;
+    s->pdoperiod = encpdo.period;
+    s->speedon = encpdo.speedon;
+    s->syncfreq = snap.freq;
+    s->position = curposition;
+    s->status = curstatus;
+    s->moving = (!isnan(movetarget) || targspd);
+    s->target = movetarget;
+    s->targspd = targspd;
+    if(stopmodel_ok) rls_getstate(&stopmodel, s->corr, s->corrP, &s->corrn, &s->corrrms);
+    movehist_save(s);
+}
+
+/**
+ * @brief save_state - checkpoint current state (for warm restart) if it changed;
+ *          position of moving motor isn't taken into account
+ */
+static void save_state(){
+    static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+    static ckptstate last;
+    static int saved = 0;
+    ckptstate cur;
+    memset(&cur, 0, sizeof(cur));
+    fill_state(&cur);
+    pthread_mutex_lock(&mtx);
+    if(cur.moving) last.position = cur.position;
+    if(!saved || memcmp(&cur, &last, sizeof(cur))){
+        ckptstate *s = ckpt_begin();
+        if(s){
+            fill_state(s);
+            ckpt_end();
+            last = cur;
+            saved = 1;
+        }
+    }
+    pthread_mutex_unlock(&mtx);
+}
+
+/**
+ * @brief warm_init - resume after restart by state checkpoint: only register
+ *          handlers and check that devices answer and position is the same;
+ *          interrupted motion is stopped
+ * @param encnode   - encoder's node ID
+ * @param motaddr   - motor's address
+ * @return 0 if state resumed, else full initialisation needed
+ */
+int warm_init(int encnode, int motaddr){
+    ckptstate s;
+    double t0 = can_dtime();
+    corr_init();
+    movehist_init();
+    if(!ckpt_load(&s) || !ckpt_sameboot(&s)) return 1; // devices were restarted after reboot
+    if(s.encnode != encnode || s.motaddr != motaddr || encnode < 0 || motaddr < 0) return 1;
+    if(s.status == STAT_DAMAGE) return 1;
+    if(s.syncfreq != snap.freq) return 1; // PDOs transmission type would be wrong
+    if(!s.pdoperiod) return 1; // position is read by SDO: encoder's state unknown
+    if(!can_ok()) init_can_io();
+    if(!can_ok()) return 1;
+    encnodenum = encnode;
+    consumeHeartbeat(encnodenum, ENC_HEARTBEAT);
+    if(pdostream_handlers(s.pdoperiod, s.speedon)) return 1;
+    emcy_register();
+    double t1 = can_dtime();
+    if(snap.freq > 0.) sendSync();
+    if(!encpdo_wait(t1, PDO_STARTWAIT)){
+        verbose("Warm start: no position PDO\n");
+        encpdo.period = encpdo.speedon = 0;
+        return 1;
+    }
+    if(!s.moving && labs((long)curposition - s.position) > RAWPOS_TOLERANCE){
+        verbose("Warm start: position changed (%ld instead of %ld)\n", curposition, s.position);
+        encpdo.period = encpdo.speedon = 0;
+        return 1;
+    }
+    if(motor_ids(motaddr)) return 1;
+    motorRDY = 1;
+    check_pimap();
+    double spd;
+    if(s.moving){ // motion was interrupted: stop motor
+        putlog("Warm start: motion to %g interrupted, stop", s.target);
+        if(stop() || CAN_NOERR != get_motor_speed(&spd)){
+            motorRDY = 0;
+            return 1;
+        }
+    }else if(CAN_NOERR != get_motor_speed(&spd)){
+        motorRDY = 0;
+        return 1;
+    }
+    encalrm.reread = 1; // alarms would be read by next getPos()
+    curstatus = s.moving ? STAT_OK : s.status;
+    encoderRDY = 1;
+    start_sync();
+    save_state();
+    verbose("Warm start in %.1fms\n", (can_dtime() - t0)*1e3);
+    putlog("Warm start in %.1fms, position %ld", (can_dtime() - t0)*1e3, curposition);
+    return 0;
+}
+
 /**
  * @brief movewconstspeed - move with constant speed
  * @param spd - given speed (rev/min)
@@ -671,16 +1925,171 @@ int movewconstspeed(int16_t spd){
         WARNX("Can't move motor!");
         return 1;
     }
+    save_state();
     return 0;
 }
 
 /**
- * @brief move - move focuser from current position to approximately `targposition` with speed `rawspeed`
+ * @brief send_speed - set motor's speed (put it into process image)
+ * @param rawspeed - raw speed value (without MOTOR_REVERSE)
+ * @return 0 if all OK
+ */
+static int send_speed(int16_t rawspeed){
+    unsigned char buf[6] = {0, CW_ENABLE,};
+    targspd = rawspeed;
+    if(MOTOR_REVERSE) rawspeed = -rawspeed;
+    buf[2] = (rawspeed >> 8) & 0xff;
+    buf[3] = rawspeed & 0xff;
+    DBG("\tBUF: %d, %d, %d, %d", buf[0], buf[1], buf[2], buf[3]);
+    return (can_send_chk(buf, NULL) != CAN_NOERR);
+}
+
+// distance (in encoder's counts) passed after stop command at raw speed `rs`; not
+// less than braking with DECEL_MAX (model could underestimate it on high speeds)
+static long stopdist(double rs){
+    double v = enck * rs, dmin = v*v / (2.*DECEL_MAX);
+    long corr = (long)rls_predict(&stopmodel, rs);
+    if(corr < dmin) corr = (long)dmin;
+    return (corr < 10) ? 10 : corr;
+}
+
+// init stopping distance model by CORR0..CORR2 or by checkpointed estimation
+static void corr_init(){
+    if(stopmodel_ok) return;
+    const double c[RLS_NPAR] = {CORR0, CORR1, CORR2};
+    ckptstate s;
+    rls_init(&stopmodel, c, CORR_XSCALE, CORR_LAMBDA, CORR_P0);
+    if(ckpt_load(&s) && s.corrn > 0){
+        rls_setstate(&stopmodel, s.corr, s.corrP, s.corrn, s.corrrms);
+        putlog("Stopping model restored: CORR=%g, %g, %g by %lu stops, RMS=%.1f",
+               s.corr[0], s.corr[1], s.corr[2], s.corrn, s.corrrms);
+    }
+    stopmodel_ok = 1;
+}
+
+/**
+ * @brief corr_sample - refine stopping distance model by one stop
+ * @param rs   - raw speed at stop command
+ * @param dist - distance passed after it
+ */
+static void corr_sample(double rs, double dist){
+    if(!stopmodel_ok || rs < RAWSPEED(MINSPEED) / 2.) return; // stall or something else
+    double pred = rls_predict(&stopmodel, rs);
+    int used = rls_update(&stopmodel, rs, dist, CORR_MAXRES);
+    DBG("Stop @ raw speed %g: distance %g, predicted %g", rs, dist, pred);
+    putlog("Stop @ raw speed %.0f: distance %.0f, predicted %.0f%s", rs, dist, pred, used ? "" : " (rejected)");
+    save_state();
+}
+
+// print stopping distance model & calibration of encoder's speed
+void print_stopmodel(char *buf, int buflen){
+    rls_print(&stopmodel, buf, buflen);
+    int l = strlen(buf);
+    if(l < buflen) snprintf(buf + l, buflen - l, "enck=%.5f\nenckn=%lu\nspeedlaw=%d\n", enck, enckn, speedlaw_on);
+}
+
+/**
+ * @brief drive_dyn - drive's dynamics by stopping model: its quadratic term is
+ *          v^2/(2*a) (`a` is limited by DECEL_MIN..DECEL_MAX), linear one is v*tlat
+ * @param a (o)    - acceleration, counts/s^2
+ * @param tlat (o) - latency of new speed setpoint (seen by encoder), s
+ */
+static void drive_dyn(double *a, double *tlat){
+    const double K = enck;
+    double c1 = rls_coef(&stopmodel, 1), c2 = rls_coef(&stopmodel, 2);
+    *a = (c2 > 0.) ? K*K / (2.*c2) : TRAJ_ACCEL;
+    if(*a < DECEL_MIN) *a = DECEL_MIN;
+    else if(*a > DECEL_MAX) *a = DECEL_MAX;
+    *tlat = c1 / K;
+    if(*tlat < 0.) *tlat = 0.;
+    else if(*tlat > SPEEDLAW_MAXLAT) *tlat = SPEEDLAW_MAXLAT;
+    // new setpoint acts after position sample & exchange cycle
+    *tlat += pimg.period + encpdo.period * 1e-3;
+}
+
+/**
+ * @brief speedlaw - max speed allowing to decelerate to MINSPEED before stopping point
+ *          with deceleration & latency of drive_dyn()
+ * @param remain - distance to target, counts
+ * @return speed in counts/s
+ */
+static double speedlaw(double remain){
+    const double vmin = enck * RAWSPEED(MINSPEED);
+    double a, tlat;
+    drive_dyn(&a, &tlat);
+    a *= SPEEDLAW_MARGIN;
+    double R = remain - stopdist(RAWSPEED(MINSPEED));
+    if(R <= 0.) return vmin;
+    // (v^2 - vmin^2)/(2a) + v*tlat = R
+    double at = a * tlat, v = -at + sqrt(at*at + vmin*vmin + 2.*a*R);
+    return (v < vmin) ? vmin : v;
+}
+
+/**
+ * @brief enck_sample - refine `enck` by encoder's speed on constant motor's speed
+ * @param k - ratio of encoder's speed (counts/s) to motor's raw speed
+ */
+static void enck_sample(double k){
+    if(k < 0.5 * ENC_CNTS_PER_RAWSPD || k > 2. * ENC_CNTS_PER_RAWSPD) return; // wrong data
+    ++enckn;
+    enck += (k - enck) / ((enckn < ENCK_WINDOW) ? enckn : ENCK_WINDOW);
+}
+
+/**
+ * @brief crnt_add - add sample of motor's current to window of move
+ * @param i - current, % of nominal
+ * @param t - its sampling time (repeated samples are ignored)
+ * @return rolling mean over CURRENT_WINDOW
+ */
+static double crnt_add(double i, double t){
+    pthread_mutex_lock(&movecrnt.mtx);
+    int last = (movecrnt.head + CURRENT_NSAMPLES - 1) % CURRENT_NSAMPLES;
+    if(movecrnt.n == 0 || t > movecrnt.t[last]){
+        movecrnt.t[movecrnt.head] = t;
+        movecrnt.i[movecrnt.head] = i;
+        last = movecrnt.head;
+        movecrnt.head = (movecrnt.head + 1) % CURRENT_NSAMPLES;
+        if(movecrnt.n < CURRENT_NSAMPLES) ++movecrnt.n;
+        ++movecrnt.nall;
+        movecrnt.sum2 += i*i;
+        if(i > movecrnt.peak) movecrnt.peak = i;
+        double sum = 0.;
+        int n = 0;
+        for(; n < movecrnt.n; ++n){
+            int idx = (last + CURRENT_NSAMPLES - n) % CURRENT_NSAMPLES;
+            if(t - movecrnt.t[idx] > CURRENT_WINDOW) break;
+            sum += movecrnt.i[idx];
+        }
+        movecrnt.mean = sum / n;
+    }
+    double mean = movecrnt.mean;
+    pthread_mutex_unlock(&movecrnt.mtx);
+    return mean;
+}
+
+// print current of last move & actual one
+void print_current(char *buf, int buflen){
+    double crnt = NAN;
+    if(get_motor_current(&crnt) != CAN_NOERR) crnt = NAN;
+    pthread_mutex_lock(&movecrnt.mtx);
+    snprintf(buf, buflen, "current=%.1f\nmean=%.1f\npeak=%.1f\nrms=%.1f\nderated=%d\nderate=%g\nlimit=%g\n",
+             crnt, movecrnt.mean, movecrnt.peak, movecrnt.nall ? sqrt(movecrnt.sum2 / movecrnt.nall) : 0.,
+             movecrnt.vcap > 0., crnt_derate, crnt_stop);
+    pthread_mutex_unlock(&movecrnt.mtx);
+}
+
+/**
+ * @brief move_ - move focuser from current position to approximately `targposition` with speed `rawspeed`
  * @param targposition - target position in raw value
- * @param rawspeed - raw speed value
+ * @param rawspeed - raw speed value (or start speed of trajectory)
+ * @param tr - trajectory to follow (NULL for constant speed), its speed setpoints are
+ *          sent in each cycle limited by speedlaw() of remaining distance (or
+ *          position error is corrected by TRAJ_KP feedback if speed law is off)
+ * Commanded speed is checked against motor's & encoder's ones by stall detector,
+ * motor's current - by envelope crnt_derate/crnt_stop
  * @return 0 if all OK
  */
-static int move(unsigned long targposition, int16_t rawspeed){
+static int move_(unsigned long targposition, int16_t rawspeed, const trajectory *tr){
     if(!motorRDY || !encoderRDY) return 1;
     //FNAME();
     long olddiffr = labs((long)targposition - (long)curposition);
@@ -690,33 +2099,32 @@ static int move(unsigned long targposition, int16_t rawspeed){
         return 0;
     }
     if(chkMove(rawspeed)) return 1;
-    unsigned char buf[6] = {0,};
+    __atomic_store_n(&encalrm.abort, 0, __ATOMIC_RELEASE);
     DBG("Start moving with speed %d, target position: %lu", REVMIN(rawspeed), targposition);
-    buf[1] = CW_ENABLE;
-    targspd = rawspeed;
-    if(MOTOR_REVERSE) rawspeed = -rawspeed;
-    buf[2] = (rawspeed >> 8) & 0xff;
-    buf[3] = rawspeed & 0xff;
-    DBG("\tBUF: %d, %d, %d, %d", buf[0], buf[1], buf[2], buf[3]);
- //unsigned char obuf[8];
-    if(can_send_chk(buf, NULL)){
+    if(send_speed(rawspeed)){
         WARNX("Can't move motor!");
         stop();
         return 1;
     }
-    //DBG("\tOBUF: %d, %d, %d, %d, %d, %d", obuf[0], obuf[1], obuf[2], obuf[3], obuf[4], obuf[5]);
-    double t0 = can_dtime();
+    double t0 = can_dtime(), dir = (rawspeed > 0) ? 1. : -1., accel, lat;
+    unsigned long startpos = curposition;
+    stalldet sd;
+    // detection window should contain a few position samples
+    double window = STALL_WINDOW;
+    if(snap.freq > 0. && window < 2. / snap.freq) window = 2. / snap.freq;
+    if(window < 2e-3 * encpdo.period) window = 2e-3 * encpdo.period;
+    drive_dyn(&accel, &lat);
+    stall_init(&sd, accel, lat, window, STALL_TOL, t0);
     // Steps after stopping = -27.96 + 9.20e-2*v + 3.79e-4*v^2, v in rev/min
     // in rawspeed = -27.96 + 1.84e-2*v + 1.52e-5*v^2
     double rs = fabs((double)rawspeed);
-    //double cv = (-27.96 + (1.84e-2 + 1.52e-5*rs)*rs);
-    double cv = (CORR0 + (CORR1 + CORR2 * rs)*rs);
-    DBG("Corr coefficients: %g, %g, %g; raw speed: %g", CORR0, CORR1, CORR2, rs);
-    long corrvalue = (long) cv; // correction due to stopping ramp
-    if(corrvalue < 10) corrvalue = 10;
+    long corrvalue = stopdist(rs); // correction due to stopping ramp
     DBG("start-> curpos: %ld, difference: %ld, corrval: %ld",
         curposition, olddiffr, corrvalue);
-    int errctr = 0, passctr = 0;
+    int passctr = 0, reached = 0;
+    double stoppos = 0., stoprs = 0.; // position & speed when stop was commanded
+    double tacc = t0; // last time when expected speed was changing
+    unsigned long lastsnap = __atomic_load_n(&snap.n, __ATOMIC_ACQUIRE);
     while(can_dtime() - t0 < MOVING_TIMEOUT){
         double speed;
         if(emerg_stop){ // emergency stop activated
@@ -725,7 +2133,16 @@ static int move(unsigned long targposition, int16_t rawspeed){
             curstatus = STAT_OK;
             return 1;
         }
-        if(get_motor_speed(&speed) != CAN_NOERR){ // WTF?
+        if(__atomic_load_n(&encalrm.abort, __ATOMIC_ACQUIRE)){ // motor already stopped by EMCY handler
+            WARNX("Encoder's emergency while moving");
+            stop();
+            curstatus = STAT_ENCERR;
+            return 1;
+        }
+        po_keepalive();
+        // with SYNC run once per snapshot
+        int rd = (snap.freq > 0.) ? snap_next(&lastsnap, &speed) : read_pos_speed(&curposition, &speed);
+        if(rd & 2){ // WTF?
             WARNX("Unknown situation: can't get speed of moving motor");
             stop();
             curstatus = STAT_ERROR;
@@ -737,30 +2154,94 @@ static int move(unsigned long targposition, int16_t rawspeed){
             stop();
             return 1;
         }
-        if(fabs(speed) < 0.1){
-            if(can_dtime() - t0 > TACCEL){
-                WARNX("Motor can't moving! Time after start=%.3fs.", can_dtime()-t0);
-                curstatus = STAT_ERROR;
+        // stall detector (position missing in this cycle is found stale by it)
+        double ms, vmot = NAN, tnow = can_dtime();
+        if(cache_get(CACHE_SPEED, CACHE_SPD_MAXAGE, &ms)) vmot = dir * enck * RAWSPEED(ms);
+        stall_command(&sd, enck * abs(targspd), tnow);
+        stallkind sk = stall_check(&sd, tnow, dir * (double)curposition, curPosTime(), vmot);
+        // calibrate enck when motor's speed is settled
+        if(!isnan(vmot) && !isnan(sd.venc) && sd.vexp == sd.vcmd && tnow - sd.tcmd > sd.lat + sd.window
+           && fabs(ms) > MINSPEED / 2.)
+            enck_sample(sd.venc / RAWSPEED(fabs(ms)));
+        if(sk != STALL_NONE){
+            WARNX("Stop by %s: commanded %.0f, expected %.0f, motor %.0f, encoder %.0f counts/s",
+                  stall_name(sk), sd.vcmd, sd.vexp, vmot, sd.venc);
+            putlog("Move stopped by %s at %.4f: commanded %.0f, expected %.0f, motor %.0f, encoder %.0f counts/s",
+                   stall_name(sk), FOC_RAW2MM(curposition), sd.vcmd, sd.vexp, vmot, sd.venc);
+            stop();
+            curstatus = (sk == STALL_ENCFREEZE) ? STAT_ENCERR : STAT_ERROR;
+            return 1;
+        }
+        double crnt, tcrnt;
+        if(!pimg.crntmap) get_motor_current(&crnt); // not in PI: read (and cache) by parameter channel
+        // stop level is checked always (higher while window contains acceleration); derating is
+        // out of acceleration only: binding increases current on constant speed (and speed law
+        // may never reach commanded one)
+        if(sd.vexp != sd.vcmd) tacc = tnow;
+        if(cache_getts(CACHE_CURRENT, CACHE_SPD_MAXAGE, &crnt, &tcrnt)){
+            double imean = crnt_add(fabs(crnt), tcrnt);
+            double istop = (tnow - tacc < CURRENT_WINDOW) ? crnt_stop * CURRENT_ACCEL_K : crnt_stop;
+            if(imean > istop){
+                WARNX("Stop by overcurrent: %.1f%% of nominal", imean);
+                putlog("Move stopped by overcurrent at %.4f: mean %.1f%% > %g%%", FOC_RAW2MM(curposition), imean, istop);
                 stop();
+                curstatus = STAT_ERROR;
                 return 1;
             }
+            if(sd.vexp >= sd.vcmd && imean > crnt_derate && movecrnt.vcap <= 0.){
+                double v = sd.vcmd * CURRENT_DERATE_K, vmin = enck * RAWSPEED(MINSPEED);
+                movecrnt.vcap = (v < vmin) ? vmin : v;
+                putlog("Speed derated by current at %.4f: mean %.1f%% > %g%%, speed %.0f -> %.0f counts/s",
+                       FOC_RAW2MM(curposition), imean, crnt_derate, sd.vcmd, movecrnt.vcap);
+                if(!tr){ // constant speed: change it right now
+                    int16_t spd = (int16_t)(dir * movecrnt.vcap / enck);
+                    if(send_speed(spd)){
+                        WARNX("Can't change speed!");
+                        stop();
+                        return 1;
+                    }
+                    rs = fabs((double)spd);
+                    if(!encpdo.speedon) corrvalue = stopdist(rs);
+                }
+            }
         }
-        if(!getLong(encnodenum, DS406_POSITION_VAL, 0, &curposition)) continue;
+        if(rd & 1) continue;
+        if(tr){ // follow trajectory
+            double sp, vp, sdone = dir * ((double)curposition - (double)startpos);
+            traj_eval(tr, curPosTime() - t0, &sp, &vp);
+            if(speedlaw_on){
+                double vl = speedlaw(fabs((double)targposition - (double)curposition));
+                if(vp > vl) vp = vl;
+            }else vp += TRAJ_KP * (sp - sdone);
+            if(movecrnt.vcap > 0. && vp > movecrnt.vcap) vp = movecrnt.vcap;
+            double rpm = REVMIN(vp / enck);
+            if(rpm < MINSPEED) rpm = MINSPEED;
+            else if(rpm > MAXSPEED) rpm = MAXSPEED;
+            int16_t spd = (int16_t)(dir * RAWSPEED(rpm));
+            if(abs(spd - targspd) >= RAWSPEED(TRAJ_SPDSTEP)){
+                if(send_speed(spd)){
+                    WARNX("Can't change speed!");
+                    stop();
+                    return 1;
+                }
+                rs = fabs((double)spd);
+                if(!encpdo.speedon) corrvalue = stopdist(rs);
+            }
+        }
+        if(encpdo.speedon) corrvalue = stopdist(fabs(RAWSPEED(speed))); // predict overshoot by real speed
         long diffr = labs((long)targposition - (long)curposition);
-        DBG("Speed: %g, curpos: %ld, diff: %ld", speed, curposition, diffr);
+        DBG("t=%.6f, speed: %g, curpos: %ld, diff: %ld", curPosTime()-t0, speed, curposition, diffr);
         if(diffr < corrvalue){
             DBG("OK! almost reach: olddif=%ld, diff=%ld, corrval=%ld, tm=%g", olddiffr, diffr, corrvalue, can_dtime()-t0);
             olddiffr = diffr;
+            reached = 1;
+            stoppos = (double)curposition;
+            stoprs = encpdo.speedon ? fabs(RAWSPEED(speed)) : rs;
             break;
         }
         if(diffr > olddiffr){ // pass over target -> stop
             if(++passctr > 2) break;
         }
-        if(diffr >= olddiffr){ // motor stall -> stop
-            ++errctr;
-            DBG("errctr: %d", errctr);
-            if(errctr > STALL_MAXCTR) break;
-        }else errctr = 0;
         olddiffr = diffr;
     }
     if(can_dtime() - t0 > MOVING_TIMEOUT){
@@ -771,6 +2252,7 @@ static int move(unsigned long targposition, int16_t rawspeed){
     }
     DBG("end-> curpos: %ld, difference: %ld, tm=%g\n", curposition, targposition - curposition, can_dtime()-t0);
     if(waitTillStop()) return 1;
+    if(reached) corr_sample(stoprs, dir * ((double)curposition - stoppos));
     if(labs((long)targposition - (long)curposition) > RAWPOS_TOLERANCE)
         verbose("Current (%ld) position is too far from target (%ld)\n", curposition, targposition);
     DBG("stop-> curpos: %ld, difference: %ld, tm=%g\n", curposition, targposition - curposition, can_dtime()-t0);
@@ -779,12 +2261,219 @@ static int move(unsigned long targposition, int16_t rawspeed){
 }
 
 /**
- * @brief move2pos - accurate focus moving to target position (in encoder's units)
- * @param target   - position 2 move (in mm)
+ * @brief move - move_() with monitoring of motor's current: its peak & RMS are logged
+ * @return 0 if all OK
+ */
+static int move(unsigned long targposition, int16_t rawspeed, const trajectory *tr){
+    pthread_mutex_lock(&movecrnt.mtx);
+    movecrnt.n = movecrnt.head = 0;
+    movecrnt.nall = 0;
+    movecrnt.sum2 = movecrnt.peak = movecrnt.mean = movecrnt.vcap = 0.;
+    pthread_mutex_unlock(&movecrnt.mtx);
+    int r = move_(targposition, rawspeed, tr);
+    pthread_mutex_lock(&movecrnt.mtx);
+    if(movecrnt.nall) putlog("Move current: peak %.1f%%, RMS %.1f%% by %lu samples%s", movecrnt.peak,
+                             sqrt(movecrnt.sum2 / movecrnt.nall), movecrnt.nall, movecrnt.vcap > 0. ? " (derated)" : "");
+    pthread_mutex_unlock(&movecrnt.mtx);
+    return r;
+}
+
+// durations of move2pos() by distance (learned) & progress of current move
+static struct{
+    pthread_mutex_t mtx;
+    int ok;                         // histogram initialised
+    unsigned long n[MOVEHIST_NBINS];
+    double T[MOVEHIST_NBINS];       // mean duration, s
+    double ratio[MOVEHIST_NBINS];   // mean ratio of duration to model's prediction
+    int active;                     // move2pos() in progress
+    double t0;                      // its start time
+    double Tpred;                   // its predicted duration
+    double target;                  // its raw target
+} movehist = {.mtx = PTHREAD_MUTEX_INITIALIZER};
+
+// histogram bin of distance `d` (counts)
+static int movehist_bin(double d){
+    int i = 0;
+    while(d >= 2. && i < MOVEHIST_NBINS - 1){
+        d /= 2.;
+        ++i;
+    }
+    return i;
+}
+
+// init histogram by checkpointed one
+static void movehist_init(){
+    ckptstate s;
+    if(movehist.ok) return;
+    pthread_mutex_lock(&movehist.mtx);
+    if(ckpt_load(&s)){
+        memcpy(movehist.n, s.histn, sizeof(movehist.n));
+        memcpy(movehist.T, s.histT, sizeof(movehist.T));
+        memcpy(movehist.ratio, s.histratio, sizeof(movehist.ratio));
+    }
+    movehist.ok = 1;
+    pthread_mutex_unlock(&movehist.mtx);
+}
+
+// store histogram in checkpoint (called from save_state())
+static void movehist_save(ckptstate *s){
+    pthread_mutex_lock(&movehist.mtx);
+    if(movehist.ok){
+        memcpy(s->histn, movehist.n, sizeof(movehist.n));
+        memcpy(s->histT, movehist.T, sizeof(movehist.T));
+        memcpy(s->histratio, movehist.ratio, sizeof(movehist.ratio));
+    }
+    pthread_mutex_unlock(&movehist.mtx);
+}
+
+// model of one move_traj(): planned profile, stop from MINSPEED (from peak speed for rough leg) & stop detection
+static double leg_time(double d, int rough){
+    trajectory tr;
+    double vmin = enck * RAWSPEED(MINSPEED), dist = d - stopdist(RAWSPEED(MINSPEED));
+    if(dist < 0.) dist = 0.;
+    if(traj_plan(&tr, dist, vmin, enck * RAWSPEED(MAXSPEED), TRAJ_ACCEL, TRAJ_JERK)) return MOVE_SETTLE;
+    if(rough) return tr.T - traj_ramptime(tr.vpeak - vmin, TRAJ_ACCEL, TRAJ_JERK) + tr.vpeak / TRAJ_ACCEL + MOVE_SETTLE;
+    return tr.T + vmin / TRAJ_ACCEL + MOVE_SETTLE;
+}
+
+/**
+ * @brief predict_move - predict duration of move2pos() by trajectory model
+ * @param from, to - raw positions
+ * @return time, s
+ */
+static double predict_move(double from, double to){
+    if(fabs(to - from) < RAWPOS_TOLERANCE) return 0.;
+    if(to < from) return leg_time(from - to + dF0, 1) + leg_time(dF0, 0); // reverse: via the left point
+    return leg_time(to - from, 0);
+}
+
+/**
+ * @brief movehist_add - learn duration of finished move
+ * @param d     - distance, counts
+ * @param T     - duration, s
+ * @param Tpred - duration predicted by model (without histogram correction)
+ */
+static void movehist_add(double d, double T, double Tpred){
+    int i = movehist_bin(d);
+    pthread_mutex_lock(&movehist.mtx);
+    if(movehist.n[i] < ETA_WINDOW) ++movehist.n[i];
+    double w = 1. / movehist.n[i];
+    movehist.T[i] += (T - movehist.T[i]) * w;
+    if(Tpred > 0.) movehist.ratio[i] += (T / Tpred - movehist.ratio[i]) * w;
+    pthread_mutex_unlock(&movehist.mtx);
+}
+
+/**
+ * @brief get_eta - remaining time of move2pos() in progress
+ * @param eta (o)      - remaining time, s
+ * @param progress (o) - part of move done (0..1)
+ * @return 1 if move is in progress
+ */
+int get_eta(double *eta, double *progress){
+    pthread_mutex_lock(&movehist.mtx);
+    if(!movehist.active){
+        pthread_mutex_unlock(&movehist.mtx);
+        return 0;
+    }
+    double dt = can_dtime() - movehist.t0, t = movehist.Tpred - dt, d = fabs(movehist.target - (double)curposition);
+    pthread_mutex_unlock(&movehist.mtx);
+    if(t <= 0.){ // move is longer than predicted: estimate by remaining distance & current speed
+        double spd, v = enck * RAWSPEED(MINSPEED);
+        if(cache_get(CACHE_SPEED, CACHE_SPD_MAXAGE, &spd) && enck * RAWSPEED(fabs(spd)) > v)
+            v = enck * RAWSPEED(fabs(spd));
+        t = d / v + MOVE_SETTLE;
+    }
+    if(eta) *eta = t;
+    if(progress) *progress = dt / (dt + t);
+    return 1;
+}
+
+/**
+ * @brief print_movetimes - print histogram of move durations
+ * @param buf    - output buffer
+ * @param buflen - its length
+ */
+void print_movetimes(char *buf, int buflen){
+    int l = 0;
+    *buf = 0;
+    pthread_mutex_lock(&movehist.mtx);
+    for(int i = 0; i < MOVEHIST_NBINS && l < buflen; ++i){
+        if(!movehist.n[i]) continue;
+        l += snprintf(buf + l, buflen - l, "<%.4fmm: n=%lu T=%.2fs ratio=%.3f\n",
+                      (double)(2UL << i) / FOCSCALE_MM, movehist.n[i], movehist.T[i], movehist.ratio[i]);
+    }
+    pthread_mutex_unlock(&movehist.mtx);
+}
+
+/**
+ * @brief move2pos - move focus to given position (target is checkpointed while moving,
+ *          duration is predicted for get_eta() and learned by histogram)
+ * @param target - target position, mm
  * @return 0 if all OK
  */
 int move2pos(double target){
     if(!motorRDY || !encoderRDY) return 1;
+    read_position();
+    double t0 = can_dtime(), from = FOC_RAW2MM(curposition), rawfrom = (double)curposition;
+    double rawto = FOC_MM2RAW(target), Tmodel = predict_move(rawfrom, rawto);
+    int bin = movehist_bin(fabs(rawto - rawfrom));
+    pthread_mutex_lock(&movehist.mtx);
+    movehist.t0 = t0;
+    movehist.target = rawto;
+    movehist.Tpred = Tmodel;
+    if(movehist.n[bin] >= ETA_MINMOVES) movehist.Tpred *= movehist.ratio[bin];
+    movehist.active = 1;
+    pthread_mutex_unlock(&movehist.mtx);
+    movetarget = target;
+    save_state();
+    int r = move2pos_(target);
+    double T = can_dtime() - t0;
+    pthread_mutex_lock(&movehist.mtx);
+    movehist.active = 0;
+    pthread_mutex_unlock(&movehist.mtx);
+    if(!r && Tmodel > 0.) movehist_add(fabs(rawto - rawfrom), T, Tmodel);
+    movetarget = NAN;
+    save_state();
+    putlog("Move %.3f -> %.3f: %s in %.2fs (predicted %.2fs), stopped at %.4f", from, target, r ? "failed" : "OK",
+           T, Tmodel, FOC_RAW2MM(curposition));
+    return r;
+}
+
+/**
+ * @brief move_traj - move to `targposition` by S-curve trajectory: accelerate from
+ *          MINSPEED, decelerate back to MINSPEED & stop when stopping distance remains;
+ *          with speed law only acceleration is planned, deceleration is by speed law
+ * @param targposition - target position in raw value
+ * @param rough        - !=0 if stop point needn't be precise: don't decelerate to MINSPEED,
+ *                       stop from peak speed by drive's ramp when its stopping distance remains
+ * @return 0 if all OK
+ */
+static int move_traj(unsigned long targposition, int rough){
+    trajectory tr;
+    double dir = (targposition > curposition) ? 1. : -1., vmin = enck * RAWSPEED(MINSPEED);
+    double dist = fabs((double)targposition - (double)curposition) - stopdist(RAWSPEED(MINSPEED));
+    if(dist < 0.) dist = 0.;
+    if(speedlaw_on) dist = (FOCMAX_MM - FOCMIN_MM) * FOCSCALE_MM; // plan never decelerates
+    if(traj_plan(&tr, dist, vmin, enck * RAWSPEED(MAXSPEED), TRAJ_ACCEL, TRAJ_JERK)){
+        WARNX("Can't plan trajectory");
+        return 1;
+    }
+    // the same peak speed, but plan never decelerates
+    if(rough && !speedlaw_on && traj_plan(&tr, (FOCMAX_MM - FOCMIN_MM) * FOCSCALE_MM, vmin, tr.vpeak, TRAJ_ACCEL, TRAJ_JERK)){
+        WARNX("Can't plan trajectory");
+        return 1;
+    }
+    DBG("Trajectory: dist=%g, vpeak=%g, T=%g", dist, tr.vpeak, tr.T);
+    return move(targposition, (int16_t)(dir * RAWSPEED(MINSPEED)), &tr);
+}
+
+/**
+ * @brief move2pos_ - accurate focus moving to target position (in encoder's units);
+ *          target is always approached from the left (backlash-safe side)
+ * @param target   - position 2 move (in mm)
+ * @return 0 if all OK
+ */
+static int move2pos_(double target){
     FNAME();
     double cur;
     if(getPos(&cur)){
@@ -801,55 +2490,43 @@ int move2pos(double target){
         verbose("Already at position\n");
         return 0;
     }
-    long spd, targ0pos = (long)targposition - (long)dF0, absdiff = labs(targ0pos - (long)curposition),
-            sign = (targ0pos > (long)curposition) ? 1 : -1;
-    DBG("absdiff: %ld", absdiff);
-    if(absdiff > ENCODER_DIFF_SPEED1) spd = sign*MAXSPEED;
-    else if(absdiff > ENCODER_DIFF_SPEED2) spd = sign*MAXSPEED / 2;
-    else if(absdiff > ENCODER_DIFF_SPEED3) spd = sign*MAXSPEED / 3;
-    else spd = sign*MINSPEED;
-    int16_t targspd = (int16_t) spd;
-    DBG("TARGSPD: %d", targspd);
-/*    if(spd > INT16_MAX) targspd = INT16_MAX;
-    else if(spd < INT16_MIN) targspd = INT16_MIN;
-    fix_targspeed(&targspd);*/
-    // check moving direction: thin focus correction always should run to negative!
-    if(targposition > curposition){ // we are from the left
-        if(targspd > MINSPEED*3/2){ // omit rough moving to focus value if there's too little distance towards target
-            // rough moving
-            DBG("1) ROUGH move to the RIGHT: curpos=%ld, difference=%ld\n", curposition, targ0pos - (long)curposition);
-            if(move(targ0pos, RAWSPEED(targspd))){
+    // we are from the right - move to the point @ left side of target, direction
+    // change needs a stop; from the left the target is reached in one motion.
+    // The leftward leg stops from its peak speed (dF0 covers error of stop model),
+    // but the last dF0 are still passed from standstill: leftward moves are slower
+    if(targposition < curposition){
+        DBG("1) move to the LEFT: curpos=%ld, difference=%ld\n", curposition, (long)targposition - dF0 - (long)curposition);
+        if(move_traj(targposition - dF0, 1)){
+            DBG("Error in move?");
+            return 1;
+        }
+        if(!read_position()){
+            WARNX("Can't get current position");
+            return 1;
+        }
+        if(labs((long)targposition - (long)curposition) < RAWPOS_TOLERANCE){
+            verbose("Catch the position @ rough moving\n");
+            return 0;
+        }
+        if(curposition > targposition){ // rough stop undershot: once more with precise stop
+            WARNX("Rough move stopped @ %.3f, repeat it", FOC_RAW2MM(curposition));
+            if(move_traj(targposition - dF0, 0)) return 1;
+            if(!read_position()){
+                WARNX("Can't get current position");
                 return 1;
             }
         }
-    }else{ // we are from the right - move to the point @ left side of target
-        DBG("1) ROUGH move to the LEFT: curpos=%ld, difference=%ld\n", curposition, targ0pos - (long)curposition);
-        if(move(targ0pos, RAWSPEED(targspd))){
-            DBG("Error in move?");
+        if(curposition > targposition){ // we should be from the left of target
+            WARNX("Error in current position: %.3f instead of %.3f!", FOC_RAW2MM(curposition), FOC_RAW2MM(targposition));
             return 1;
         }
     }
-    // now move precisely
-    if(!getLong(encnodenum, DS406_POSITION_VAL, 0, &curposition)){
-        WARNX("Can't get current position");
-        return 1;
-    }
-    if(labs((long)targposition - (long)curposition) < RAWPOS_TOLERANCE){
-        verbose("Catch the position @ rough moving\n");
-        DBG("Catch the position @ rough moving");
-        return 0;
-    }
-    if(curposition > targposition){ // we should be from the left of target
-        WARNX("Error in current position: %.3f instead of %.3f!", FOC_RAW2MM(curposition), FOC_RAW2MM(targposition));
-        return 1;
-    }
     DBG("2) curpos: %ld, difference: %ld\n", curposition, (long)targposition - (long)curposition);
-    // now make an accurate moving
-    if(move(targposition, RAWSPEED(MINSPEED))){
+    if(move_traj(targposition, 0)){
         WARNX("Can't catch focus precisely!");
         return 1;
     }
-    if(!getLong(encnodenum, DS406_POSITION_VAL, 0, &curposition)){
+    if(!read_position()){
         WARNX("Can't get current position");
         return 1;
     }
@@ -864,9 +2541,18 @@ int move2pos(double target){
 int get_pos_speed(unsigned long *pos, double *speed){
     FNAME();
     int ret = 0;
+    if(pos && speed && encoderRDY && motorRDY){
+        if(read_pos_speed(pos, speed)){
+            *speed = 0.;
+            return 1;
+        }
+        if(MOTOR_REVERSE) *speed = -*speed;
+        return 0;
+    }
     if(pos){
         if(!encoderRDY) *pos = FOC_MM2RAW(3.);
-        else if(!getLong(encnodenum, DS406_POSITION_VAL, 0, pos)) ret = 1;
+        else if(!read_position()) ret = 1;
+        else *pos = curposition;
     }
     if(speed){
         if(!motorRDY){
@@ -889,7 +2575,7 @@ void movewithmon(double spd){
         return;
     }
     unsigned long pos, oldpos = 0, startpos;
-    double speed;
+    double speed, motspd = 0.;
     get_pos_speed(&startpos, NULL); // starting position
     int16_t targspd = RAWSPEED(spd);
     buf[1] = CW_ENABLE;
@@ -902,17 +2588,22 @@ void movewithmon(double spd){
     }
     double t0 = can_dtime(), tlast = t0;
     green("\nAcceleration with monitoring not longer than for 4 seconds\n\n");
-#define PRINT()  do{printf("t=%g, pos=%lu (%.3fmm), spd=%g, Dpos=%.0f\n", tcur - t0, pos, \
-    FOC_RAW2MM(pos), speed, oldpos ? ((double)pos - oldpos)/(tcur - tlast) : 0);}while(0)
+    // with encoder's speed `speed` is measured at load side, also show motor's speed
+#define PRINT()  do{printf("t=%g, pos=%lu (%.3fmm), spd=%g, Dpos=%.0f", tcur - t0, pos, \
+    FOC_RAW2MM(pos), speed, oldpos ? ((double)pos - oldpos)/(tcur - tlast) : 0); \
+    printf(encpdo.speedon ? ", motspd=%g\n" : "\n", motspd);}while(0)
     while(can_dtime() - t0 < 4.){
+        po_keepalive();
         if(get_pos_speed(&pos, &speed)){ // can't get speed? WTF?
             WARNX("Strange things are going here...");
             break;
         }
-        double tcur = can_dtime();
+        double tcur = curPosTime();
+        if(!encpdo.speedon) motspd = speed;
+        else if(CAN_NOERR == get_motor_speed(&motspd) && MOTOR_REVERSE) motspd = -motspd;
         PRINT();
         oldpos = pos;
-        if(fabs(speed - spd) < 1.){
+        if(fabs(motspd - spd) < 1.){
             green("\tTarget speed reached for %.2fs, DPOS=%ld\n", tlast - t0, pos - startpos);
             break;
         }
@@ -921,30 +2612,36 @@ void movewithmon(double spd){
     }
     green("\nMove for 3 seconds with constant speed\n\n");
     get_pos_speed(&startpos, NULL);
-    t0 = can_dtime();
+    t0 = tlast = curPosTime();
     do{
-        can_dsleep(0.5);
+        for(int i = 0; i < 5; ++i){
+            po_keepalive();
+            can_dsleep(0.1);
+        }
         if(get_pos_speed(&pos, &speed)){ // can't get speed? WTF?
             WARNX("Strange things are going there...");
             break;
         }
-        double tcur = can_dtime();
+        double tcur = curPosTime();
         PRINT();
         oldpos = pos;
         tlast = tcur;
     }while(can_dtime() - t0 < 3.);
     double meanspd = ((double)pos - startpos) / (tlast - t0);
     green("\tMean pos speed: %.0f (%g mm/s)\n", meanspd, FOC_RAW2MM(meanspd));
+    green("\tEncoder counts/s per raw speed unit: %.4f (ENC_CNTS_PER_RAWSPD=%g, calibrated %g by %lu samples)\n",
+          meanspd / RAWSPEED(spd), ENC_CNTS_PER_RAWSPD, enck, enckn);
     green("\nStop with monitoring not longer than for 4 seconds\n\n");
     get_pos_speed(&startpos, NULL);
     t0 = can_dtime();
     for(int i = 0; i < 100 && stop(); ++i);
     while(can_dtime() - t0 < 4.){
-        get_pos_speed(&pos, NULL);
-        double tcur = can_dtime();
+        get_pos_speed(&pos, encpdo.speedon ? &speed : NULL);
+        double tcur = curPosTime();
         PRINT();
         if(oldpos == pos){
             green("\tStopped for %.2fs, DPOS=%ld\n", tlast - t0, pos - startpos);
+            corr_sample(RAWSPEED(fabs(spd)), fabs((double)pos - (double)startpos));
             break;
         }
         oldpos = pos;
@@ -957,3 +2654,53 @@ void movewithmon(double spd){
 sysstatus get_status(){
     return curstatus;
 }
+
+/**
+ * @brief movebench - benchmark of move2pos(): moves between each pair of BENCH_NPOINTS
+ *          points over `span` mm from current position with speed law & by planned
+ *          trajectory only
+ * @param span - span of points, mm
+ */
+void movebench(double span){
+    if(!motorRDY || !encoderRDY) return;
+    double cur, pts[BENCH_NPOINTS], tsum[2] = {0., 0.};
+    int nmoves = 0, oldlaw = speedlaw_on;
+    if(span <= 0. || getPos(&cur)) return;
+    if(cur + span > FOCMAX_MM - ESW_DIST_ALLOW) cur = FOCMAX_MM - ESW_DIST_ALLOW - span;
+    if(cur < FOCMIN_MM + ESW_DIST_ALLOW){
+        WARNX("Span is too large");
+        return;
+    }
+    for(int i = 0; i < BENCH_NPOINTS; ++i) pts[i] = cur + span * i / (BENCH_NPOINTS - 1);
+    green("\nBenchmark: moves between %d points from %.3f to %.3fmm\n\n", BENCH_NPOINTS, pts[0], pts[BENCH_NPOINTS-1]);
+    for(int i = 0; i < BENCH_NPOINTS; ++i) for(int j = 0; j < BENCH_NPOINTS; ++j){
+        if(i == j) continue;
+        double t[2];
+        for(int m = 0; m < 2; ++m){
+            speedlaw_on = !m;
+            if(move2pos(pts[i])) goto bad;
+            double t0 = can_dtime();
+            if(move2pos(pts[j])) goto bad;
+            t[m] = can_dtime() - t0;
+            tsum[m] += t[m];
+        }
+        ++nmoves;
+        printf("%.3f -> %.3f: speed law %.2fs, trajectory %.2fs\n", pts[i], pts[j], t[0], t[1]);
+    }
+    green("\nMean move time: speed law %.2fs, trajectory only %.2fs (%.1f%% less)\n",
+          tsum[0] / nmoves, tsum[1] / nmoves, 100. * (1. - tsum[0] / tsum[1]));
+    speedlaw_on = oldlaw;
+    return;
+bad:
+    WARNX("Benchmark interrupted");
+    speedlaw_on = oldlaw;
+}
+
+/**
+ * @brief set_speedlaw - turn on/off speed limit by remaining distance (before it
+ *          check ENC_CNTS_PER_RAWSPD by `-m` monitoring)
+ * @param on - !0 to turn on
+ */
+void set_speedlaw(int on){
+    speedlaw_on = on;
+}
@@ -46,22 +46,50 @@ typedef enum{
     STAT_GOFROMESW, // mowing from end-switch
     STAT_ERROR,     // error state
     STAT_FORBIDDEN, // forbidden position
-    STAT_DAMAGE     // the device in damaged state and can't work further
+    STAT_DAMAGE,    // the device in damaged state and can't work further
+    STAT_ENCERR     // encoder's alarm or emergency
 } sysstatus;
 
-int init_encoder(int encnode, int reset);
+// encoder's alarms and emergency messages
+typedef struct{
+    uint16_t alarms;        // DS406 alarms (0x6503)
+    uint16_t warnings;      // DS406 warnings (0x6505)
+    uint16_t emcycode;      // error code of last EMCY (0 - no error or error reset)
+    uint8_t errreg;         // error register from last EMCY
+    unsigned long nemcy;    // amount of EMCY messages received
+    double emcytime;        // time of last EMCY
+} encalarms;
+
+int set_sync(double freq);
+int set_curlimits(double derate, double stop);
+int init_encoder(int encnode, int reset, int pdoperiod, int encspeed);
 void returnPreOper(long long presetval);
+int enc_cfgsave(const char *name);
+int enc_cfgload(const char *name);
 int getPos(double *pos);
 double curPos();
+double curPosTime();
 int init_motor_ids(int addr);
+int init_devices(int encnode, int reset, int pdoperiod, int encspeed, int motaddr);
+int warm_init(int encnode, int motaddr);
 void movewithmon(double spd);
+void movebench(double span);
+void set_speedlaw(int on);
 canstatus get_motor_speed(double *spd);
+canstatus get_motor_current(double *crnt);
 canstatus get_endswitches(eswstate *Esw);
 int move2pos(double target);
 int stop();
 int movewconstspeed(int16_t spd);
 int go_out_from_ESW();
 sysstatus get_status();
+void get_alarms(encalarms *a);
+void print_rtt(char *buf, int buflen);
+void print_cache(char *buf, int buflen);
+void print_stopmodel(char *buf, int buflen);
+void print_movetimes(char *buf, int buflen);
+int get_eta(double *eta, double *progress);
+void print_current(char *buf, int buflen);
 int get_pos_speed(unsigned long *pos, double *speed);
 
 #endif // CAN_ENCODER_H__
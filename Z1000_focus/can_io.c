@@ -16,7 +16,10 @@
 #include <linux/sockios.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include <poll.h>
+#include <pthread.h>
 
 #include "can_io.h"
 
@@ -25,6 +28,34 @@ static int can_sck = -1;       /* can raw socket */
 static struct timeval start_tv, tv;
 static double start_time;
 
+/* receive thread: reads socket and routes frames into queues by COB-ID */
+#define CAN_RXQ_LEN 64          /* ring buffer length, power of 2 */
+typedef struct {
+    int nfilt;
+    struct can_filter filt[CAN_RX_MAXF];
+    unsigned int head;          /* written only by receive thread */
+    unsigned int tail;          /* changed under mtx only */
+    int waiting;                /* amount of consumers waiting on cond (changed under mtx) */
+    unsigned long overruns;
+    can_rx_cb handler;          /* called by receive thread instead of queueing */
+    void *harg;
+    can_rxframe ring[CAN_RXQ_LEN];
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+} can_rxq;
+static can_rxq rxq[CAN_RX_MAXQ];
+static int rxq_n = 0;
+static pthread_mutex_t rxq_reg_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t rx_thread;
+static unsigned long rx_routed = 0, rx_unrouted = 0, rx_stale = 0;
+static void *can_rx_thread(void *arg);
+
+/* kernel-side filtering: only frames of registered queues reach userspace */
+static int use_filters = 1;
+static unsigned long rx_packets0 = 0;   /* interface counter at start */
+static unsigned long if_rx_packets();
+static void can_update_filters();
+
 void set_sending_mode(int x) {return;}
 int can_sending_mode() {return(0);}
 
@@ -50,6 +81,17 @@ void *init_can_io() {
     addr.can_family = AF_CAN;
     addr.can_ifindex = ifr.ifr_ifindex;
 
+    pthread_mutex_lock(&rxq_reg_mtx);
+    can_update_filters();
+    pthread_mutex_unlock(&rxq_reg_mtx);
+    rx_packets0 = if_rx_packets();
+    {   /* nanosecond kernel (and hardware if any) timestamps in control data */
+	int on = 1, flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	if(setsockopt(can_sck, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0 &&
+	   setsockopt(can_sck, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+	    perror("setsockopt(SO_TIMESTAMPNS)");
+    }
     if(bind(can_sck, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 	perror("bind CAN socket");
 	can_exit(0);
@@ -59,6 +101,10 @@ void *init_can_io() {
     start_time = (double)start_tv.tv_sec + (double)start_tv.tv_usec/1e6;
     tv.tv_sec = tv.tv_usec = 0;
 
+    if(pthread_create(&rx_thread, NULL, can_rx_thread, NULL)) {
+	perror("CAN receive thread");
+	can_exit(0);
+    }
 
     signal(SIGHUP, can_exit);
     signal(SIGINT, can_exit);
@@ -108,61 +154,347 @@ int can_wait(int fd, double tout)
     return(0);
 }
 
-/* for compatibility with my old can-library  */
-void can_clean_recv(int *psock, double *rtime) {
-    struct timeval tmv;
-    struct timezone tz;
-    gettimeofday(&tmv,&tz);
-    *rtime = tmv.tv_sec + (double)tmv.tv_usec/1000000.;
-    *psock = can_sck;
-    if(can_sck>0) {
-	int n=0;
-	struct can_frame frame;
-	fcntl(can_sck, F_SETFL, O_NONBLOCK);
-	do {
-	    n=recv(can_sck, &frame, sizeof(struct can_frame),0);
-	} while(n>0);
-	if(n<0 && errno != EAGAIN) {
-	    perror("recv from CAN-socket"); fflush(stderr);
+/* switch kernel filtering on/off (call it before init_can_io()) */
+void can_set_filtering(int on) {
+    use_filters = on;
+}
+
+/* set CAN_RAW_FILTER to the union of all queue filters; call with rxq_reg_mtx locked */
+static void can_update_filters() {
+    struct can_filter filt[CAN_RX_MAXQ*CAN_RX_MAXF];
+    int i, f, n = 0;
+    if(can_sck < 0 || !use_filters) return;
+    for(i = 0; i < rxq_n; i++)
+	for(f = 0; f < rxq[i].nfilt; f++)
+	    filt[n++] = rxq[i].filt[f];
+    /* zero filters means "receive nothing" */
+    if(setsockopt(can_sck, SOL_CAN_RAW, CAN_RAW_FILTER, filt, n*sizeof(struct can_filter)) < 0) {
+	perror("setsockopt(CAN_RAW_FILTER)"); fflush(stderr);
+    }
+}
+
+/* total amount of frames received by CAN interface */
+static unsigned long if_rx_packets() {
+    char path[128];
+    unsigned long n = 0;
+    FILE *f;
+    snprintf(path, 128, "/sys/class/net/%s/statistics/rx_packets", &can_dev[5]);
+    if(!(f = fopen(path, "r"))) return 0;
+    if(fscanf(f, "%lu", &n) != 1) n = 0;
+    fclose(f);
+    return n;
+}
+
+/* put frame into each queue with matching filter; never blocks */
+static void can_rx_dispatch(can_rxframe *fr) {
+    int i, f, n = __atomic_load_n(&rxq_n, __ATOMIC_ACQUIRE), routed = 0;
+    for(i = 0; i < n; i++) {
+	can_rxq *q = &rxq[i];
+	int nf = __atomic_load_n(&q->nfilt, __ATOMIC_ACQUIRE);
+	for(f = 0; f < nf; f++)
+	    if((fr->id & q->filt[f].can_mask) == (q->filt[f].can_id & q->filt[f].can_mask)) break;
+	if(f == nf) continue;
+	routed = 1;
+	if(q->handler) {
+	    q->handler(fr, q->harg);
+	    continue;
+	}
+	unsigned int h = q->head;
+	if(h - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= CAN_RXQ_LEN) {
+	    /* nobody reads this queue for a long time: drop the new frame (the oldest one
+	     * could be held by can_rx_peek(), taking mtx would block receive thread) */
+	    q->overruns++;
+	    continue;
+	}
+	q->ring[h % CAN_RXQ_LEN] = *fr;
+	__atomic_store_n(&q->head, h+1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+	    pthread_mutex_lock(&q->mtx);
+	    pthread_cond_broadcast(&q->cond);
+	    pthread_mutex_unlock(&q->mtx);
 	}
     }
+    if(routed) rx_routed++;
+    else rx_unrouted++;
 }
 
-int can_recv_frame(int *psock, double *rtime,
-		  canid_t *id, int *length, unsigned char data[]) {
-    int i,n=0;
-    struct can_frame frame;
+/* fill frame timestamps from control data of received message:
+ * SO_TIMESTAMPING (software & raw hardware) or SO_TIMESTAMPNS */
+static void can_msg_time(struct msghdr *msg, can_rxframe *fr) {
+    struct cmsghdr *cm;
+    int got = 0;
+    memset(&fr->hwts, 0, sizeof(struct timespec));
+    for(cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+	if(cm->cmsg_level != SOL_SOCKET) continue;
+	if(cm->cmsg_type == SCM_TIMESTAMPING) {
+	    struct scm_timestamping st;
+	    memcpy(&st, CMSG_DATA(cm), sizeof(st));
+	    fr->ts = st.ts[0];
+	    fr->hwts = st.ts[2];
+	    got = (st.ts[0].tv_sec != 0);
+	} else if(cm->cmsg_type == SCM_TIMESTAMPNS) {
+	    memcpy(&fr->ts, CMSG_DATA(cm), sizeof(struct timespec));
+	    got = 1;
+	}
+    }
+    if(!got) clock_gettime(CLOCK_REALTIME, &fr->ts);
+    fr->rtime = can_ts2d(&fr->ts);
+}
+
+/* read all frames available by one recvmmsg() and route them */
+#define CAN_RX_BATCH 16
+static void *can_rx_thread(void *arg) {
+    struct can_frame frames[CAN_RX_BATCH];
+    struct iovec iov[CAN_RX_BATCH];
+    struct mmsghdr msgs[CAN_RX_BATCH];
+    char ctrl[CAN_RX_BATCH][CMSG_SPACE(sizeof(struct scm_timestamping))];
     struct pollfd pfd;
-    if(*psock > 0) {
-	pfd.fd = *psock;
-	pfd.events=POLLIN;
-	pfd.revents=0;
-	if((n=poll(&pfd,1,1))<0) {
+    can_rxframe fr;
+    int i, n;
+    (void)arg;
+    while(can_sck > 0) {
+	pfd.fd = can_sck;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if((n = poll(&pfd, 1, 100)) < 0) {
+	    if(errno == EINTR) continue;
 	    perror("CAN-socket poll() error"); fflush(stderr);
-	    return(0);
+	    break;
+	}
+	if(n == 0) continue;
+	for(i = 0; i < CAN_RX_BATCH; i++) {
+	    iov[i].iov_base = &frames[i];
+	    iov[i].iov_len = sizeof(struct can_frame);
+	    memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	    msgs[i].msg_hdr.msg_control = ctrl[i];
+	    msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+	}
+	n = recvmmsg(can_sck, msgs, CAN_RX_BATCH, MSG_DONTWAIT, NULL);
+	if(n < 0) {
+	    if(errno == EAGAIN || errno == EINTR) continue;
+	    perror("recvmmsg from CAN-socket"); fflush(stderr);
+	    break;
 	}
-	if(n==0) return(0);
-	n=recv(*psock, &frame, sizeof(struct can_frame),0);
-	if(n<0 && errno != EAGAIN) {
-	    perror("recv frame from CAN-socket"); fflush(stderr);
-	} else if(n>0) {
-	    if(frame.len>8) frame.len=8; // no CAN FD frames in our systems!
-	    *id = frame.can_id;
-	    *length = frame.len;
-	    for(i = 0; i < frame.len; i++)
-		data[i] = frame.data[i];
-	    if(ioctl(*psock, SIOCGSTAMP, &tv)<0) {
-		perror("ioctl(to get frame timestamp)"); fflush(stderr);
-	    } else
-		*rtime = tv.tv_sec + (double)tv.tv_usec/1000000.;
-	    return(1);
+	for(i = 0; i < n; i++) {
+	    struct can_frame *frame = &frames[i];
+	    if(msgs[i].msg_len < sizeof(struct can_frame)) continue;
+	    if(frame->len > 8) frame->len = 8;
+	    fr.id = frame->can_id;
+	    fr.len = frame->len;
+	    memcpy(fr.data, frame->data, 8);
+	    can_msg_time(&msgs[i].msg_hdr, &fr);
+	    can_rx_dispatch(&fr);
 	}
     }
-    return(0);
+    return NULL;
+}
+
+static int can_rx_register(canid_t id, canid_t mask, can_rx_cb handler, void *arg) {
+    pthread_condattr_t ca;
+    can_rxq *q;
+    int n;
+    pthread_mutex_lock(&rxq_reg_mtx);
+    n = rxq_n;
+    if(n >= CAN_RX_MAXQ) {
+	pthread_mutex_unlock(&rxq_reg_mtx);
+	fprintf(stderr, "Too many CAN receive queues\n");
+	return -1;
+    }
+    q = &rxq[n];
+    memset(q, 0, sizeof(can_rxq));
+    q->filt[0].can_id = id;
+    q->filt[0].can_mask = mask;
+    q->nfilt = 1;
+    q->handler = handler;
+    q->harg = arg;
+    pthread_mutex_init(&q->mtx, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &ca);
+    pthread_condattr_destroy(&ca);
+    __atomic_store_n(&rxq_n, n+1, __ATOMIC_RELEASE);
+    can_update_filters();
+    pthread_mutex_unlock(&rxq_reg_mtx);
+    return n;
+}
+
+/* register new receive queue for frames with (ID & mask) == (id & mask);
+ * returns queue number or -1 if there's no more free queues */
+int can_rx_queue(canid_t id, canid_t mask) {
+    return can_rx_register(id, mask, NULL, NULL);
+}
+
+/* register handler called right from the receive thread for each matching
+ * frame (frames aren't queued); it shouldn't block or do any CAN I/O.
+ * Returns handler's queue number (for can_rx_addfilter) or -1 */
+int can_rx_handler(canid_t id, canid_t mask, can_rx_cb handler, void *arg) {
+    if(!handler) return -1;
+    return can_rx_register(id, mask, handler, arg);
+}
+
+/* add one more filter to queue q; return 0 if failed */
+int can_rx_addfilter(int q, canid_t id, canid_t mask) {
+    can_rxq *Q;
+    if(q < 0 || q >= rxq_n) return 0;
+    Q = &rxq[q];
+    pthread_mutex_lock(&rxq_reg_mtx);
+    if(Q->nfilt >= CAN_RX_MAXF) {
+	pthread_mutex_unlock(&rxq_reg_mtx);
+	return 0;
+    }
+    Q->filt[Q->nfilt].can_id = id;
+    Q->filt[Q->nfilt].can_mask = mask;
+    __atomic_store_n(&Q->nfilt, Q->nfilt+1, __ATOMIC_RELEASE);
+    can_update_filters();
+    pthread_mutex_unlock(&rxq_reg_mtx);
+    return 1;
+}
+
+/* zero-copy receive: wait up to `tout` seconds for frame received not earlier
+ * than `since` and return pointer to it right in the queue ring (stale frames
+ * are thrown away); the frame is valid till can_rx_release(q), which should be
+ * called at once (other consumers of q wait for it; new frames are dropped if
+ * the queue overflows meanwhile). Return NULL if timeout */
+const can_rxframe *can_rx_peek(int q, double since, double tout) {
+    struct timespec ts;
+    can_rxq *Q;
+    if(q < 0 || q >= rxq_n) return NULL;
+    Q = &rxq[q];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if(tout > 0.) {
+	ts.tv_sec += (time_t)tout;
+	ts.tv_nsec += (long)((tout - (time_t)tout)*1e9);
+	if(ts.tv_nsec >= 1000000000L) {
+	    ts.tv_sec++;
+	    ts.tv_nsec -= 1000000000L;
+	}
+    }
+    pthread_mutex_lock(&Q->mtx);
+    __atomic_add_fetch(&Q->waiting, 1, __ATOMIC_SEQ_CST);
+    do {
+	while(Q->tail != __atomic_load_n(&Q->head, __ATOMIC_SEQ_CST)) {
+	    can_rxframe *fr = &Q->ring[Q->tail % CAN_RXQ_LEN];
+	    if(fr->rtime >= since) {
+		__atomic_sub_fetch(&Q->waiting, 1, __ATOMIC_SEQ_CST);
+		return fr;      /* mutex stays locked till can_rx_release() */
+	    }
+	    rx_stale++;
+	    __atomic_store_n(&Q->tail, Q->tail+1, __ATOMIC_RELEASE);
+	}
+	if(tout <= 0.) break;
+    } while(pthread_cond_timedwait(&Q->cond, &Q->mtx, &ts) != ETIMEDOUT ||
+	    Q->tail != __atomic_load_n(&Q->head, __ATOMIC_SEQ_CST));
+    __atomic_sub_fetch(&Q->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&Q->mtx);
+    return NULL;
 }
+
+/* free frame got by can_rx_peek() */
+void can_rx_release(int q) {
+    can_rxq *Q = &rxq[q];
+    __atomic_store_n(&Q->tail, Q->tail+1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&Q->mtx);
+}
+
+/* wait for the frame received not earlier than `since` (the time when
+ * request was sent), older answers (stale) in queue q are thrown away;
+ * return 1 if got frame, 0 if timeout */
+int can_rx_wait_since(int q, double since, double tout, can_rxframe *fr) {
+    const can_rxframe *f = can_rx_peek(q, since, tout);
+    if(!f) return 0;
+    if(fr) *fr = *f;
+    can_rx_release(q);
+    return 1;
+}
+
+/* wait up to `tout` seconds for the next frame in queue q;
+ * return 1 if got frame, 0 if timeout */
+int can_rx_wait(int q, double tout, can_rxframe *fr) {
+    return can_rx_wait_since(q, 0., tout, fr);
+}
+
+/* statistics of receive thread */
+void can_rx_stats(unsigned long *routed, unsigned long *unrouted, unsigned long *stale, unsigned long *overruns) {
+    int i;
+    if(routed) *routed = rx_routed;
+    if(unrouted) *unrouted = rx_unrouted;
+    if(stale) *stale = rx_stale;
+    if(overruns) {
+	*overruns = 0;
+	for(i = 0; i < rxq_n; i++) *overruns += rxq[i].overruns;
+    }
+}
+
+/* frames passed to userspace and rejected by kernel filters since init;
+ * rejected is estimated as increment of interface's rx_packets (sysfs) minus passed,
+ * so it counts all frames not taken by this socket (whatever other sockets do) and is 0 without sysfs */
+void can_filter_stats(unsigned long *passed, unsigned long *rejected) {
+    unsigned long p = rx_routed + rx_unrouted, total = if_rx_packets() - rx_packets0;
+    if(passed) *passed = p;
+    if(rejected) *rejected = (total > p) ? total - p : 0;
+}
+
+/* frames collected between can_tx_begin() and can_tx_flush() (per thread) */
+#define CAN_TX_BATCH 16
+static __thread struct can_frame txbatch[CAN_TX_BATCH];
+static __thread int txbatch_n = -1;
+
+/* interface's tx queue is short (txqueuelen 10): on its overflow wait for frames to leave */
+#define CAN_TX_RETRIES 50
+#define CAN_TX_PAUSE   1000 /* us, ~one frame on 125 kbit/s */
+
+/* return 1 if send failed by full tx queue and may be retried (after pause) */
+static int tx_retry(int *tries) {
+    if((errno != ENOBUFS && errno != EAGAIN) || ++*tries > CAN_TX_RETRIES) return(0);
+    usleep(CAN_TX_PAUSE);
+    return(1);
+}
+
+/* send array of frames by one sendmmsg(); return amount of frames sent */
+int can_send_frames(int n, struct can_frame frames[]) {
+    struct iovec iov[CAN_TX_BATCH];
+    struct mmsghdr msgs[CAN_TX_BATCH];
+    int i, sent = 0, tries = 0;
+    if(can_sck < 0) return(-1);
+    while(sent < n) {
+	int r, nb = n - sent;
+	if(nb > CAN_TX_BATCH) nb = CAN_TX_BATCH;
+	memset(msgs, 0, nb*sizeof(struct mmsghdr));
+	for(i = 0; i < nb; i++) {
+	    iov[i].iov_base = &frames[sent+i];
+	    iov[i].iov_len = sizeof(struct can_frame);
+	    msgs[i].msg_hdr.msg_iov = &iov[i];
+	    msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	if((r = sendmmsg(can_sck, msgs, nb, 0)) <= 0) {
+	    if(tx_retry(&tries)) continue;
+	    perror("sendmmsg to CAN-socket"); fflush(stderr);
+	    break;
+	}
+	sent += r;
+	tries = 0;
+    }
+    return(sent);
+}
+
+/* collect all frames sent by this thread till can_tx_flush() */
+void can_tx_begin() {
+    txbatch_n = 0;
+}
+
+/* send frames collected after can_tx_begin() by one syscall */
+int can_tx_flush() {
+    int n = txbatch_n, r = 0;
+    txbatch_n = -1;
+    if(n > 0) r = can_send_frames(n, txbatch);
+    return(r == n);
+}
+
 /* send tx-frame from client process */
 int can_send_frame(canid_t id, int length, unsigned char data[]) {
-    int i, ret=1;
+    int i, ret=1, tries=0;
     struct can_frame frame;
     if(can_sck<0)
        return(-1);
@@ -172,8 +504,18 @@ int can_send_frame(canid_t id, int length, unsigned char data[]) {
     frame.can_id = id;
     frame.len = length;
     for(i=0;i<length;i++) frame.data[i]=data[i];
-    if(send(can_sck, &frame, sizeof(struct can_frame),0)<0) {
+    if(txbatch_n >= 0) { /* batch mode: send later */
+	if(txbatch_n == CAN_TX_BATCH) {
+	    can_send_frames(txbatch_n, txbatch);
+	    txbatch_n = 0;
+	}
+	txbatch[txbatch_n++] = frame;
+	return(ret);
+    }
+    while(send(can_sck, &frame, sizeof(struct can_frame),0)<0) {
+	if(tx_retry(&tries)) continue;
 	perror("send frame to CAN-socket"); fflush(stderr);
+	break;
     }
     return(ret);
 }
@@ -241,6 +583,10 @@ double can_dsleep(double dt) {
    return((double)ts.tv_sec + (double)ts.tv_nsec/1e9);
 }
 
+double can_ts2d(const struct timespec *ts) {
+   return ((double)ts->tv_sec + (double)ts->tv_nsec/1e9);
+}
+
 double can_dtime() {
    struct timeval ct;
    struct timezone tz;
@@ -1,6 +1,12 @@
 /* CAN I/O library (for compatibility with the old one,      */
 /*                  but through the new SocketCAN interface) */
 
+#pragma once
+#ifndef CAN_IO_H__
+#define CAN_IO_H__
+
+#include <stdio.h>
+#include <time.h>
 #include <linux/can.h>
 
 #ifndef CAN_RTR_FLAG
@@ -11,19 +17,51 @@
 #endif
 #define CAN_EXT_FLAG  CAN_EFF_FLAG
 
+/* default mask: exact standard ID, no RTR, no extended frames */
+#define CAN_RX_EXACT  (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_SFF_MASK)
+/* max amount of receive queues & filters per queue */
+#define CAN_RX_MAXQ   32
+#define CAN_RX_MAXF   4
+
+/* frame routed by the receive thread into its queue */
+typedef struct {
+    canid_t id;
+    int len;
+    unsigned char data[8];
+    struct timespec ts;     /* kernel receive time, ns */
+    struct timespec hwts;   /* raw hardware timestamp (zero if not supported) */
+    double rtime;           /* ts in seconds */
+} can_rxframe;
+
+/* frame handler called by the receive thread */
+typedef void (*can_rx_cb)(const can_rxframe *fr, void *arg);
+
 int can_wait(int fd, double tout);
 #define can_delay(Tout) can_wait(0, Tout)
 void *init_can_io();
 int can_ok();
 #define can_io_ok()  can_ok()
-void can_clean_recv(int *psock, double *rtime);
-int can_recv_frame(int *psock, double *rtime,
-		  canid_t *id, int *length, unsigned char data[]);
 int can_send_frame(canid_t id, int length, unsigned char data[]);
+int can_send_frames(int n, struct can_frame frames[]);
+void can_tx_begin();
+int can_tx_flush();
 void can_exit(int sig);
 char *time2asc(double t);
 double can_dsleep(double dt);
 double can_dtime();
+double can_ts2d(const struct timespec *ts);
 void can_prtime(FILE *fd);
 void set_sending_mode(int);
+void can_set_filtering(int on);
+void can_filter_stats(unsigned long *passed, unsigned long *rejected);
+int can_rx_queue(canid_t id, canid_t mask);
+int can_rx_handler(canid_t id, canid_t mask, can_rx_cb handler, void *arg);
+int can_rx_addfilter(int q, canid_t id, canid_t mask);
+int can_rx_wait(int q, double tout, can_rxframe *fr);
+int can_rx_wait_since(int q, double since, double tout, can_rxframe *fr);
+const can_rxframe *can_rx_peek(int q, double since, double tout);
+void can_rx_release(int q);
+void can_rx_stats(unsigned long *routed, unsigned long *unrouted, unsigned long *stale, unsigned long *overruns);
 int can_sending_mode();
+
+#endif // CAN_IO_H__
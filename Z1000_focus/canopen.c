@@ -1,10 +1,107 @@
 // (c) vsher@sao.ru
+#include <pthread.h>
 #include "canopen.h"
 #include "sdo_abort_codes.h"
+#include "objdict.h"
+#include "rtt.h"
 
+// heartbeat is lost if there was no messages during HB_CONSUMER_FACTOR periods
+#define HB_CONSUMER_FACTOR  1.5
 
-static int rxpnt=-1;
-static double rxtime=0.;
+// receive queues (created on first use): SDO responses & PDO1/PDO2 of any node;
+// handlers of NMT/guarding messages by node
+static int sdoq[128], nmtq[128], pdoq = -1;
+static int queues_inited = 0;
+// time of last SDO request to node & of last PDO request (SYNC, RTR or NMT):
+// answers received before it are stale
+static double sdotag[128], pdotag = 0.;
+// receive time of last SDO answer from node
+static struct timespec sdorxts[128];
+// SDO round-trip times by node (timeouts are chosen by them)
+static rttstat sdortt[128] = {[0 ... 127] = RTTSTAT_INIT("SDO")};
+// node states by heartbeat, node guarding answers & bootup (filled by receive thread)
+static struct{
+    int state;          // last state
+    double rtime;       // its receive time
+    double boottime;    // receive time of last bootup message
+    int hbperiod;       // heartbeat period, ms (0 - no heartbeat)
+    double cmdtime;     // time of last NMT command to node
+} nodest[128];
+static pthread_mutex_t nmtmtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t nmtcond = PTHREAD_COND_INITIALIZER;
+
+static void init_queues(){
+    if(queues_inited) return;
+    for(int i = 0; i < 128; ++i) sdoq[i] = nmtq[i] = -1;
+    queues_inited = 1;
+}
+
+static int sdo_queue(int node){
+    init_queues();
+    node &= 0x7f;
+    if(sdoq[node] < 0) sdoq[node] = can_rx_queue(0x580|node, CAN_RX_EXACT);
+    return sdoq[node];
+}
+
+static void nmt_handler(const can_rxframe *fr, void *arg){
+    (void)arg;
+    if(fr->len != 1) return;
+    int node = fr->id & 0x7f;
+    pthread_mutex_lock(&nmtmtx);
+    nodest[node].state = fr->data[0] & 0x7f;
+    nodest[node].rtime = fr->rtime;
+    if(nodest[node].state == 0){ // bootup: node was reset
+        nodest[node].boottime = fr->rtime;
+        od_invalidate(node);
+    }
+    pthread_cond_broadcast(&nmtcond);
+    pthread_mutex_unlock(&nmtmtx);
+}
+
+static int nmt_queue(int node){
+    init_queues();
+    node &= 0x7f;
+    // node guarding answers & bootup/heartbeat messages
+    if(nmtq[node] < 0) nmtq[node] = can_rx_handler(0x700|node, CAN_RX_EXACT, nmt_handler, NULL);
+    return nmtq[node];
+}
+
+// wait for NMT message (bootup only if `bootup`!=0) from node received after `since`;
+// return node state or -1 if timeout
+static int nmt_wait(int node, double since, double tout, int bootup){
+    struct timespec ts;
+    int state = -1;
+    node &= 0x7f;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (time_t)tout;
+    ts.tv_nsec += (long)((tout - (time_t)tout)*1e9);
+    if(ts.tv_nsec >= 1000000000L){
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&nmtmtx);
+    do{
+        if(bootup){
+            if(nodest[node].boottime >= since){
+                state = 0;
+                break;
+            }
+        }else if(nodest[node].rtime >= since){
+            state = nodest[node].state;
+            break;
+        }
+    }while(!pthread_cond_timedwait(&nmtcond, &nmtmtx, &ts));
+    pthread_mutex_unlock(&nmtmtx);
+    return state;
+}
+
+static int pdo_queue(){
+    if(pdoq < 0){
+        pdoq = can_rx_queue(0x180, CAN_EFF_FLAG|CAN_RTR_FLAG|0x780); // PDO1 of any node
+        can_rx_addfilter(pdoq, 0x280, CAN_EFF_FLAG|CAN_RTR_FLAG|0x780); // PDO2
+    }
+    return pdoq;
+}
 
 int sendNMT(int node, int icode){
     unsigned long idt=0;
@@ -12,55 +109,339 @@ int sendNMT(int node, int icode){
     unsigned char tdata[2] = {0};
     tdata[0] = icode&0xff;
     tdata[1] = node&0x7f;
+    pdotag = can_dtime();
+    if(icode == 0x81 || icode == 0x82) od_invalidate(tdata[1]);
+    if(tdata[1]) nodest[tdata[1]].cmdtime = pdotag;
+    else for(int i = 1; i < 128; ++i) nodest[i].cmdtime = pdotag;
     return (can_send_frame(idt, dlen, tdata) > 0);
 }
 
 int resetNode2(int oldnode, int newnode){
-    int dlen,ntout=50;
-    canid_t idr;
-    unsigned char rdata[8];
-    can_clean_recv(&rxpnt, &rxtime);
+    if(nmt_queue(newnode) < 0) return 0;
+    double t0 = can_dtime();
     if(!sendNMT(oldnode, 0x81)) return 0;
-    for(int i=0; i < ntout; ++i){
-        can_dsleep(0.01);
-        while(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata)){
-            if(idr == (0x700|((canid_t)newnode)) && dlen==1 && rdata[0] == 0) return 1;
-        }
-    }
-    return 0;
+    // after reset node doesn't produce heartbeat till reconfiguration
+    nodest[oldnode&0x7f].hbperiod = 0;
+    return (nmt_wait(newnode, t0, 0.5, 1) == 0); // bootup message
 }
 
 int resetNode(int node){return resetNode2(node,node);}
 
+// return 1 if heartbeat of node is enabled but lost
+int heartbeatLost(int node){
+    node &= 0x7f;
+    if(!nodest[node].hbperiod) return 0;
+    return (can_dtime() - nodest[node].rtime > HB_CONSUMER_FACTOR * nodest[node].hbperiod * 1e-3);
+}
+
+// consume heartbeat of node already producing it with period `ms`
+int consumeHeartbeat(int node, int ms){
+    if(ms < 0 || ms > 0xffff) return 0;
+    if(nmt_queue(node) < 0) return 0;
+    nodest[node&0x7f].hbperiod = ms;
+    return 1;
+}
+
+// set heartbeat producer time (ms) of node and consume its heartbeat (0 - turn off)
+int setHeartbeat(int node, int ms){
+    if(ms < 0 || ms > 0xffff) return 0;
+    if(nmt_queue(node) < 0) return 0;
+    if(!setShort(node, 0x1017, 0, (unsigned short)ms)) return 0;
+    return consumeHeartbeat(node, ms);
+}
+
 int getNodeState(int node){
-    /* use Node Guarding Protocol */
-    unsigned long idt = (0x700 | (node&0x7f) | CAN_RTR_FLAG);
-    int dlen = 0, ntout = 15;
-    canid_t idr;
-    unsigned char rdata[8];
-    can_clean_recv(&rxpnt, &rxtime);
-    if(can_send_frame(idt, dlen, rdata)<=0) return 0;
-    for(int i=0; i < ntout; ++i){
-        can_dsleep(0.01);
-        while(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata)) {
-            if(idr == (0x700|((canid_t)node)) && dlen == 1) return rdata[0]&0x7f;
+    int state;
+    if(nmt_queue(node) < 0) return 0;
+    if(nodest[node&0x7f].hbperiod){ // heartbeat consumer: state is known without requests
+        double hbtime = HB_CONSUMER_FACTOR * nodest[node&0x7f].hbperiod * 1e-3;
+        if(nodest[node&0x7f].rtime < nodest[node&0x7f].cmdtime){ // wait for new state after NMT command
+            state = nmt_wait(node, nodest[node&0x7f].cmdtime, hbtime, 0);
+            return (state < 0) ? 0 : state;
         }
+        if(heartbeatLost(node)) return 0;
+        pthread_mutex_lock(&nmtmtx);
+        state = nodest[node&0x7f].state;
+        pthread_mutex_unlock(&nmtmtx);
+        return state;
     }
-    return 0;
+    /* use Node Guarding Protocol */
+    unsigned long idt = (0x700 | (node&0x7f) | CAN_RTR_FLAG);
+    unsigned char dummy[1];
+    double t0 = can_dtime();
+    if(can_send_frame(idt, 0, dummy)<=0) return 0;
+    state = nmt_wait(node, t0, 0.15, 0);
+    return (state < 0) ? 0 : state;
 }
 
 int initNode(int node){
     int state;
-    if(rxpnt<0){
-        init_can_io();
-        can_clean_recv(&rxpnt, &rxtime);
-    }
+    if(!can_ok()) init_can_io();
     if(!can_ok()) return 0;
     if((state = getNodeState(node)) == 0) return 0;
     if(state != NodePreOperational) setPreOper(node);
     return 1;
 }
 
+// asynchronous SDO: one outstanding request per node, the rest wait in node's list;
+// receive thread only stores answers, SDO worker thread finishes requests (callbacks,
+// timeouts) and sends the next request of node
+static pthread_mutex_t sdomtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sdocond = PTHREAD_COND_INITIALIZER;
+static sdo_req *sdohead[128], *sdotail[128];
+static int sdoh = -1;
+static pthread_t sdothread;
+static int sdoworker = 0;
+// synchronous SDO transaction of node (from request till answer or the whole segmented
+// or block transfer): others wait for its end, async requests are sent after it
+static struct{
+    pthread_t owner;
+    int depth;              // nesting level (0 - node is free)
+} sdotrans[128];
+
+// storing/restoring parameters takes much more time than usual requests
+static int sdo_slow(int object){
+    return (object == 0x1010 || object == 0x1011);
+}
+
+// timeout of answer to request
+static double sdo_tout(int node, int object){
+    return sdo_slow(object) ? 0.5 : rtt_tout(&sdortt[node&0x7f], 0.15);
+}
+
+// SDO round-trip times statistics of node
+rttstat *sdoRTT(int node){
+    return &sdortt[node&0x7f];
+}
+
+// make request's frame and mark request as sent (call with sdomtx locked)
+static void sdo_req_prep(sdo_req *r, unsigned char tdata[8]){
+    memset(tdata, 0, 8);
+    tdata[0] = 0x40; tdata[1] = r->object&0xff; tdata[2] = (r->object>>8)&0xff; tdata[3] = r->subindex&0xff;
+    if(r->write){
+        tdata[0] = 0x23 | ((4 - r->len)<<2);
+        memcpy(&tdata[4], r->data, r->len);
+    }
+    r->tsent = can_dtime();
+    sdotag[r->node] = r->tsent;
+}
+
+// send frame made by sdo_req_prep() with sdomtx unlocked: waiting for full tx queue shouldn't
+// block receive thread; request which wasn't sent expires by timeout
+static void sdo_req_send(int node, unsigned char tdata[8]){
+    can_send_frame(0x600 | node, 8, tdata);
+}
+
+// finish head request of node: start the next one, call callback & release waiter
+// (call with sdomtx locked from worker; it's unlocked while sending and callback runs)
+static void sdo_done(int node){
+    sdo_req *r = sdohead[node];
+    unsigned char tdata[8];
+    int next = 0, cb = (r->cb != NULL);
+    sdohead[node] = r->next;
+    if(!sdohead[node]) sdotail[node] = NULL;
+    else if(!sdotrans[node].depth){
+        sdo_req_prep(sdohead[node], tdata);
+        next = 1;
+    }
+    r->incb = cb; // request is out of list, its waiter waits for callback's end
+    r->status = r->result;
+    pthread_mutex_unlock(&sdomtx);
+    if(next) sdo_req_send(node, tdata);
+    if(cb) r->cb(r, r->arg); // without callback `r` could be already released by waiter
+    pthread_mutex_lock(&sdomtx);
+    if(cb) r->incb = 0;
+    pthread_cond_broadcast(&sdocond);
+}
+
+// time till timeout of node's outstanding request (or till default check if none)
+static double sdo_left(int node){
+    if(!sdohead[node] || sdotrans[node].depth || sdohead[node]->result != SDO_PENDING) return 0.1;
+    return sdohead[node]->tsent + sdo_tout(node, sdohead[node]->object) - can_dtime();
+}
+
+// wait for any SDO event not longer than `tout` seconds (call with sdomtx locked)
+static void sdo_waitevent(double tout){
+    struct timespec ts;
+    if(tout < 0.001) tout = 0.001;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += (long)(tout*1e9);
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&sdocond, &sdomtx, &ts);
+}
+
+// SDO worker: finish answered & expired requests
+static void *sdo_worker(void *arg){
+    (void)arg;
+    pthread_mutex_lock(&sdomtx);
+    while(1){
+        double tout = 0.1;
+        for(int i = 1; i < 128; ++i){
+            if(sdohead[i] && !sdotrans[i].depth && sdohead[i]->result == SDO_PENDING && sdo_left(i) < 0.){
+                fprintf(stderr,"Can't get SDO response from Node%d! Timeout?\n",i);
+                if(!sdo_slow(sdohead[i]->object)) rtt_lost(&sdortt[i]);
+                sdohead[i]->result = SDO_TIMEOUT;
+            }
+            if(sdohead[i] && sdohead[i]->result != SDO_PENDING){
+                sdo_done(i);
+                tout = 0.; // lists could be changed while sdomtx was unlocked: check them again
+            }else{
+                double t = sdo_left(i);
+                if(t < tout) tout = t;
+            }
+        }
+        if(tout > 0.) sdo_waitevent(tout);
+    }
+    return NULL;
+}
+
+// store answer to node's outstanding request: receive thread shouldn't send anything or run callbacks
+static void sdo_handler(const can_rxframe *fr, void *arg){
+    (void)arg;
+    int node = fr->id & 0x7f;
+    const unsigned char *d = fr->data;
+    if(fr->len < 4) return;
+    pthread_mutex_lock(&sdomtx);
+    sdo_req *r = sdohead[node];
+    if(r && r->result == SDO_PENDING && r->tsent > 0. && fr->rtime >= r->tsent &&
+       ((d[2]<<8)|d[1]) == r->object && d[3] == r->subindex){
+        sdo_status st = SDO_ERROR;
+        r->rtt = fr->rtime - r->tsent;
+        r->ts = fr->ts;
+        if(d[0] == 0x80){
+            r->abortcode = (d[7]<<24)|(d[6]<<16)|(d[5]<<8)|d[4];
+            st = SDO_ABORTED;
+        }else if(r->write){
+            if(d[0] == 0x60) st = SDO_DONE;
+        }else if((d[0] & 0xe2) == 0x42){ // expedited upload; segmented isn't supported here
+            r->len = (d[0] & 1) ? 4 - ((d[0]>>2)&3) : 4;
+            memcpy(r->data, &d[4], 4);
+            st = SDO_DONE;
+        }
+        if(st == SDO_DONE) sdorxts[node] = fr->ts;
+        if(!sdo_slow(r->object)) rtt_add(&sdortt[node], r->rtt);
+        r->result = st;
+        pthread_cond_broadcast(&sdocond);
+    }
+    pthread_mutex_unlock(&sdomtx);
+}
+
+// start transaction: wait till asynchronous requests to node are finished and other
+// thread's transaction ends (nested calls of the same thread are allowed)
+static void sdo_begin(int node){
+    pthread_t self = pthread_self();
+    node &= 0x7f;
+    pthread_mutex_lock(&sdomtx);
+    if(sdotrans[node].depth && pthread_equal(sdotrans[node].owner, self)){
+        ++sdotrans[node].depth;
+        pthread_mutex_unlock(&sdomtx);
+        return;
+    }
+    while(sdohead[node] || sdotrans[node].depth) sdo_waitevent(0.1);
+    sdotrans[node].owner = self;
+    sdotrans[node].depth = 1;
+    pthread_mutex_unlock(&sdomtx);
+}
+
+// end transaction, send async request submitted while it was active
+static void sdo_end(int node){
+    node &= 0x7f;
+    unsigned char tdata[8];
+    int next = 0;
+    pthread_mutex_lock(&sdomtx);
+    if(sdotrans[node].depth && --sdotrans[node].depth == 0){
+        if(sdohead[node]){
+            sdo_req_prep(sdohead[node], tdata);
+            next = 1;
+        }
+        pthread_cond_broadcast(&sdocond);
+    }
+    pthread_mutex_unlock(&sdomtx);
+    if(next) sdo_req_send(node, tdata);
+}
+
+// put request into node's list; it's sent at once if node has no outstanding request;
+// callback (if any) is called by SDO worker thread, it shouldn't block or wait for SDO
+int sdoSubmit(sdo_req *r){
+    if(!r || r->node < 1 || r->node > 127) return 0;
+    if(r->write && (r->len < 1 || r->len > 4)) return 0;
+    pthread_mutex_lock(&sdomtx);
+    if(!sdoworker){
+        if(pthread_create(&sdothread, NULL, sdo_worker, NULL)){
+            pthread_mutex_unlock(&sdomtx);
+            perror("SDO worker thread");
+            return 0;
+        }
+        sdoworker = 1;
+    }
+    pthread_mutex_unlock(&sdomtx);
+    if(sdoh < 0 && (sdoh = can_rx_handler(0x580, CAN_EFF_FLAG|CAN_RTR_FLAG|0x780, sdo_handler, NULL)) < 0)
+        return 0;
+    unsigned char tdata[8];
+    int node = r->node, send = 0;
+    pthread_mutex_lock(&sdomtx);
+    r->status = r->result = SDO_PENDING;
+    r->incb = 0;
+    r->next = NULL;
+    r->tsent = 0.;
+    if(sdotail[node]) sdotail[node]->next = r;
+    else{
+        sdohead[node] = r;
+        if(!sdotrans[node].depth){
+            sdo_req_prep(r, tdata);
+            send = 1;
+        }
+    }
+    sdotail[node] = r;
+    pthread_mutex_unlock(&sdomtx);
+    if(send) sdo_req_send(node, tdata);
+    return 1;
+}
+
+// fill request to read object and submit it
+int sdoGetAsync(sdo_req *r, int node, int object, int subindex, sdo_cb cb, void *arg){
+    memset(r, 0, sizeof(sdo_req));
+    r->node = node&0x7f; r->object = object; r->subindex = subindex;
+    r->cb = cb; r->arg = arg;
+    return sdoSubmit(r);
+}
+
+// fill request to write `len` bytes of value and submit it
+int sdoSetAsync(sdo_req *r, int node, int object, int subindex, unsigned long value, int len, sdo_cb cb, void *arg){
+    memset(r, 0, sizeof(sdo_req));
+    r->node = node&0x7f; r->object = object; r->subindex = subindex;
+    r->write = 1; r->len = len;
+    for(int i = 0; i < 4; ++i, value >>= 8) r->data[i] = value & 0xff;
+    r->cb = cb; r->arg = arg;
+    return sdoSubmit(r);
+}
+
+// wait for request completion; return 1 if it's done successfully
+int sdoWait(sdo_req *r){
+    pthread_mutex_lock(&sdomtx);
+    while(r->status == SDO_PENDING || r->incb) sdo_waitevent(0.1);
+    pthread_mutex_unlock(&sdomtx);
+    if(r->status == SDO_ABORTED)
+        fprintf(stderr,"SDO error %08lx from Node%d (object %04x/%d)\n(%s)\n",r->abortcode,r->node,
+                r->object,r->subindex,sdo_abort_text(r->abortcode));
+    return (r->status == SDO_DONE);
+}
+
+// wait for all n requests; return amount of successful
+int sdoWaitAll(sdo_req r[], int n){
+    int good = 0;
+    for(int i = 0; i < n; ++i) good += sdoWait(&r[i]);
+    return good;
+}
+
+// value got by upload request (little-endian)
+unsigned long sdoValue(const sdo_req *r){
+    unsigned long v = 0;
+    for(int i = r->len - 1; i >= 0; --i) v = (v << 8) | r->data[i];
+    return v;
+}
+
 int sendSDOdata(int node, int func, int object, int subindex, unsigned char data[]){
     unsigned long idt = 0x600 | (node&0x7f);
     int dlen = 8;
@@ -87,7 +468,11 @@ int sendSDOdata(int node, int func, int object, int subindex, unsigned char data
         case 0x40: break;
         default: return 0;
     }
-    return (can_send_frame(idt, dlen, tdata) > 0);
+    sdo_begin(node); // ends in recvSDOresp()
+    sdotag[node&0x7f] = can_dtime();
+    if(can_send_frame(idt, dlen, tdata) > 0) return 1;
+    sdo_end(node);
+    return 0;
 }
 
 int sendSDOreq(int node, int object, int subindex){
@@ -95,56 +480,73 @@ int sendSDOreq(int node, int object, int subindex){
     return sendSDOdata(node, 0x40, object, subindex, dummy);
 }
 
+// check SDO response frame right in the receive queue;
+// return -1 if it isn't an answer to our request, else like recvSDOresp()
+static int parseSDOresp(int node, int t_func, int t_object, int t_subindex, const can_rxframe *fr, unsigned char data[]){
+    const unsigned char *rdata = fr->data;
+    int r_func, r_object, r_subindex, dlen;
+    if(fr->len < 4){
+        fprintf(stderr,"Too short SDO response from Node%d\n",node&0x7f);
+        return -1;
+    }
+    r_func = rdata[0];
+    r_object = (rdata[2]<<8)|rdata[1];
+    r_subindex = rdata[3];
+    if(r_func == 0x80){ // got SDO error code
+        unsigned long ercode = (rdata[7]<<24)|(rdata[6]<<16)|(rdata[5]<<8)|rdata[4];
+        fprintf(stderr,"SDO error %08lx from Node%d (object %04x/%d) \n",ercode,node&0x7f,r_object,r_subindex);
+        fprintf(stderr,"(%s)\n",sdo_abort_text(ercode));
+        return 0;
+    }
+    if(r_object!=t_object || r_subindex != t_subindex){
+        fprintf(stderr,"Got SDO response with a stranger object (%04x/%d instead of %04x/%d) from Node%d\n",r_object,r_subindex,t_object,t_subindex,node&0x7f);
+        return -1;
+    }
+    if((t_func&0xf0) == 0x20 && r_func == 0x60) return 1;
+    if(t_func == 0x40 && (r_func&0xf0) == 0x40){
+        dlen = 0;
+        switch (r_func & 0x7f){
+            default:
+            case 0x43: data[3] = rdata[7]; dlen++;
+                // FALLTHRU
+            case 0x47: data[2] = rdata[6]; dlen++;
+                // FALLTHRU
+            case 0x4b: data[1] = rdata[5]; dlen++;
+                // FALLTHRU
+            case 0x4f: data[0] = rdata[4]; dlen++;
+            break;
+        }
+        return dlen;
+    }
+    fprintf(stderr,"Suspicious SDO response from Node%d (func %02x object %04x/%d)\n",node&0x7f,r_func,r_object,r_subindex);
+    return -1;
+}
+
 int recvSDOresp(int node, int t_func, int t_object, int t_subindex, unsigned char data[]){
-    int idt = 0x580|(node&0x7f);
-    int dlen = 0;
-    canid_t idr;
-    unsigned char rdata[8] = {0};
-    int ntout = (t_object == 0x1010||t_object == 0x1011)? 50 : 15;
-    for(int i = 0; i < ntout; ++i){
-        can_dsleep(0.01);
-        while(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata)) if(idr==(canid_t)idt){
-            int r_func, r_object, r_subindex;
-            if(dlen < 4){
-                fprintf(stderr,"Too short SDO response from Node%d\n",node&0x7f);
-                continue;
-            }
-            r_func = rdata[0];
-            r_object = (rdata[2]<<8)|rdata[1];
-            r_subindex = rdata[3];
-            if(r_func == 0x80){ // got SDO error code
-                unsigned long ercode = (rdata[7]<<24)|(rdata[6]<<16)|(rdata[5]<<8)|rdata[4];
-                fprintf(stderr,"SDO error %08lx from Node%d (object %04x/%d) \n",ercode,node&0x7f,r_object,r_subindex);
-                fprintf(stderr,"(%s)\n",sdo_abort_text(ercode));
-                return 0;
-            }
-            if(r_object!=t_object || r_subindex != t_subindex){
-                fprintf(stderr,"Got SDO response with a stranger object (%04x/%d instead of %04x/%d) from Node%d\n",r_object,r_subindex,t_object,t_subindex,node&0x7f);
-                continue;
-            }
-            if((t_func&0xf0) == 0x20 && r_func == 0x60) return 1;
-            if(t_func == 0x40 && (r_func&0xf0) == 0x40){
-                dlen = 0;
-                switch (r_func & 0x7f){
-                    default:
-                    case 0x43: data[3] = rdata[7]; dlen++;
-                        // FALLTHRU
-                    case 0x47: data[2] = rdata[6]; dlen++;
-                        // FALLTHRU
-                    case 0x4b: data[1] = rdata[5]; dlen++;
-                        // FALLTHRU
-                    case 0x4f: data[0] = rdata[4]; dlen++;
-                    break;
-                }
-                return dlen;
-            }
-            fprintf(stderr,"Suspicious SDO response from Node%d (func %02x object %04x/%d)\n",node&0x7f,r_func,r_object,r_subindex);
+    int q = sdo_queue(node);
+    double te = can_dtime() + sdo_tout(node, t_object);
+    const can_rxframe *fr;
+    while((fr = can_rx_peek(q, sdotag[node&0x7f], te - can_dtime()))){
+        int r = parseSDOresp(node, t_func, t_object, t_subindex, fr, data);
+        if(r > 0) sdorxts[node&0x7f] = fr->ts;
+        if(r >= 0 && !sdo_slow(t_object)) rtt_add(&sdortt[node&0x7f], fr->rtime - sdotag[node&0x7f]);
+        can_rx_release(q);
+        if(r >= 0){
+            sdo_end(node);
+            return r;
         }
     }
+    sdo_end(node);
+    if(!sdo_slow(t_object)) rtt_lost(&sdortt[node&0x7f]);
     fprintf(stderr,"Can't get SDO response from Node%d! Timeout?\n",node&0x7f);
     return 0;
 }
 
+// kernel receive time of the last successful SDO answer from node
+void SDOrxtime(int node, struct timespec *ts){
+    *ts = sdorxts[node&0x7f];
+}
+
 int doSDOdownload(int node, int object, int subindex, unsigned char data[], int dlen){
     int func = 0x22;
     switch(dlen){
@@ -154,16 +556,285 @@ int doSDOdownload(int node, int object, int subindex, unsigned char data[], int
         case 2: func = 0x2b; break;
         case 1: func = 0x2f; break;
     }
-    can_clean_recv(&rxpnt, &rxtime);
     if(!sendSDOdata(node, func, object, subindex, data)) return 0;
     return recvSDOresp(node, func, object, subindex, data);
 }
 
 int doSDOupload(int node, int object, int subindex, unsigned char data[]){
-    int func = 0x40;
-    can_clean_recv(&rxpnt, &rxtime);
+    int func = 0x40, dlen;
+    // static objects are read only once after reset
+    if((dlen = od_cache_get(node&0x7f, object, subindex, data))) return dlen;
     if(!sendSDOdata(node, func, object, subindex, data)) return 0;
-    return recvSDOresp(node, func, object, subindex, data);
+    dlen = recvSDOresp(node, func, object, subindex, data);
+    if(dlen > 0) od_cache_put(node&0x7f, object, subindex, data, dlen);
+    return dlen;
+}
+
+// segmented & block transfers
+#define SDO_TOUT        0.15
+// block size: less than receive queue length as the whole block comes at once
+#define SDO_BLKSIZE     32
+
+// send raw SDO request frame (inside of transaction)
+static int sdo_send(int node, unsigned char tdata[8]){
+    sdotag[node&0x7f] = can_dtime();
+    return (can_send_frame(0x600 | (node&0x7f), 8, tdata) > 0);
+}
+
+// abort SDO transfer with given code
+static void sdo_abort(int node, int object, int subindex, unsigned long code){
+    unsigned char tdata[8] = {0x80, object&0xff, (object>>8)&0xff, subindex&0xff,
+                              code&0xff, (code>>8)&0xff, (code>>16)&0xff, (code>>24)&0xff};
+    sdo_send(node, tdata);
+}
+
+// wait for next SDO frame from server (answer to last request); return 0 if timeout or abort
+static int sdo_recv(int node, can_rxframe *fr){
+    if(!can_rx_wait_since(sdo_queue(node), sdotag[node&0x7f], SDO_TOUT, fr)){
+        fprintf(stderr,"Can't get SDO response from Node%d! Timeout?\n",node&0x7f);
+        return 0;
+    }
+    if(fr->data[0] == 0x80){
+        unsigned long ercode = (fr->data[7]<<24)|(fr->data[6]<<16)|(fr->data[5]<<8)|fr->data[4];
+        fprintf(stderr,"SDO error %08lx from Node%d\n(%s)\n",ercode,node&0x7f,sdo_abort_text(ercode));
+        return 0;
+    }
+    sdorxts[node&0x7f] = fr->ts;
+    return 1;
+}
+
+// check that answer is for our object
+static int sdo_chkobj(const can_rxframe *fr, int object, int subindex){
+    return (fr->data[1] == (object&0xff) && fr->data[2] == ((object>>8)&0xff) && fr->data[3] == (subindex&0xff));
+}
+
+// CRC-16-CCITT (polynomial 0x1021, initial value 0) for block transfers
+static unsigned short sdo_crc(const unsigned char *buf, int len, unsigned short crc){
+    for(int i = 0; i < len; ++i){
+        crc ^= (unsigned short)buf[i] << 8;
+        for(int b = 0; b < 8; ++b)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// upload object of any size (expedited or segmented) into buf;
+// return data length or -1 if failed (data larger than maxlen is truncated)
+static int sdoUpload_(int node, int object, int subindex, unsigned char *buf, int maxlen){
+    unsigned char tdata[8] = {0x40, object&0xff, (object>>8)&0xff, subindex&0xff};
+    can_rxframe fr;
+    int len = 0, toggle = 0;
+    if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return -1;
+    if((fr.data[0] & 0xe0) != 0x40 || !sdo_chkobj(&fr, object, subindex)){
+        fprintf(stderr,"Suspicious SDO response from Node%d (func %02x)\n",node&0x7f,fr.data[0]);
+        return -1;
+    }
+    if(fr.data[0] & 2){ // expedited
+        len = (fr.data[0] & 1) ? 4 - ((fr.data[0]>>2)&3) : 4;
+        if(len > maxlen) len = maxlen;
+        memcpy(buf, &fr.data[4], len);
+        return len;
+    }
+    // segmented
+    while(1){
+        memset(tdata, 0, 8);
+        tdata[0] = 0x60 | toggle;
+        if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return -1;
+        if((fr.data[0] & 0xe0) != 0x00){
+            fprintf(stderr,"Wrong SDO segment from Node%d (func %02x)\n",node&0x7f,fr.data[0]);
+            sdo_abort(node, object, subindex, 0x05040001);
+            return -1;
+        }
+        if((fr.data[0] & 0x10) != toggle){
+            fprintf(stderr,"SDO toggle bit not alternated (Node%d)\n",node&0x7f);
+            sdo_abort(node, object, subindex, 0x05030000);
+            return -1;
+        }
+        int n = 7 - ((fr.data[0]>>1)&7);
+        if(len + n > maxlen) n = maxlen - len;
+        if(n > 0){
+            memcpy(buf + len, &fr.data[1], n);
+            len += n;
+        }
+        if(fr.data[0] & 1) break; // last segment
+        toggle ^= 0x10;
+    }
+    return len;
+}
+
+// sdoUpload_() as one transaction
+int sdoUpload(int node, int object, int subindex, unsigned char *buf, int maxlen){
+    sdo_begin(node);
+    int r = sdoUpload_(node, object, subindex, buf, maxlen);
+    sdo_end(node);
+    return r;
+}
+
+// download data of any size (expedited if len <= 4, else segmented); return 1 if OK
+static int sdoDownload_(int node, int object, int subindex, const unsigned char *buf, int len){
+    unsigned char tdata[8] = {0, object&0xff, (object>>8)&0xff, subindex&0xff};
+    can_rxframe fr;
+    int pos = 0, toggle = 0;
+    if(len <= 4){ // expedited
+        tdata[0] = 0x23 | ((4-len)<<2);
+        memcpy(&tdata[4], buf, len);
+    }else{ // initiate segmented with size indicated
+        tdata[0] = 0x21;
+        tdata[4] = len&0xff; tdata[5] = (len>>8)&0xff; tdata[6] = (len>>16)&0xff; tdata[7] = (len>>24)&0xff;
+    }
+    if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return 0;
+    if(fr.data[0] != 0x60 || !sdo_chkobj(&fr, object, subindex)){
+        fprintf(stderr,"Suspicious SDO response from Node%d (func %02x)\n",node&0x7f,fr.data[0]);
+        return 0;
+    }
+    while(pos < len){
+        int n = len - pos;
+        if(n > 7) n = 7;
+        memset(tdata, 0, 8);
+        tdata[0] = toggle | ((7-n)<<1) | ((pos + n == len) ? 1 : 0);
+        memcpy(&tdata[1], buf + pos, n);
+        if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return 0;
+        if((fr.data[0] & 0xef) != 0x20 || (fr.data[0] & 0x10) != toggle){
+            fprintf(stderr,"Wrong SDO segment answer from Node%d (func %02x)\n",node&0x7f,fr.data[0]);
+            sdo_abort(node, object, subindex, (fr.data[0] & 0xe0) == 0x20 ? 0x05030000 : 0x05040001);
+            return 0;
+        }
+        pos += n;
+        toggle ^= 0x10;
+    }
+    return 1;
+}
+
+// sdoDownload_() as one transaction
+int sdoDownload(int node, int object, int subindex, const unsigned char *buf, int len){
+    sdo_begin(node);
+    int r = sdoDownload_(node, object, subindex, buf, len);
+    sdo_end(node);
+    return r;
+}
+
+// block upload (with CRC if server supports it); return data length or -1 if failed
+// (e.g. server doesn't support block transfer, use sdoUpload() then)
+static int sdoBlockUpload_(int node, int object, int subindex, unsigned char *buf, int maxlen){
+    unsigned char tdata[8] = {0xA4, object&0xff, (object>>8)&0xff, subindex&0xff, SDO_BLKSIZE, 0};
+    can_rxframe fr;
+    int len = 0, crcon, last = 0; // len - total amount of bytes received (even if > maxlen)
+    if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return -1;
+    if((fr.data[0] & 0xf9) != 0xC0 || !sdo_chkobj(&fr, object, subindex)){
+        fprintf(stderr,"Suspicious SDO block response from Node%d (func %02x)\n",node&0x7f,fr.data[0]);
+        sdo_abort(node, object, subindex, 0x05040001);
+        return -1;
+    }
+    crcon = fr.data[0] & 4;
+    memset(tdata, 0, 8);
+    tdata[0] = 0xA3; // start upload
+    if(!sdo_send(node, tdata)) return -1;
+    while(!last){ // receive sub-blocks
+        int seq = 0;
+        while(1){
+            if(!sdo_recv(node, &fr)) return -1;
+            int s = fr.data[0] & 0x7f;
+            if(s == seq + 1){ // next segment
+                if(len < maxlen) memcpy(buf + len, &fr.data[1], (maxlen - len < 7) ? maxlen - len : 7);
+                len += 7;
+                seq = s;
+                if(fr.data[0] & 0x80){ last = 1; break; }
+            } // else segment lost: skip the rest of sub-block and ask to repeat from seq+1
+            if(s == SDO_BLKSIZE || (fr.data[0] & 0x80)) break;
+        }
+        memset(tdata, 0, 8);
+        tdata[0] = 0xA2; tdata[1] = seq; tdata[2] = SDO_BLKSIZE;
+        if(!sdo_send(node, tdata)) return -1;
+    }
+    // end of block: number of unused bytes in last segment & CRC
+    if(!sdo_recv(node, &fr)) return -1;
+    if((fr.data[0] & 0xe3) != 0xC1){
+        sdo_abort(node, object, subindex, 0x05040001);
+        return -1;
+    }
+    len -= (fr.data[0]>>2)&7;
+    if(len > maxlen){
+        fprintf(stderr,"SDO block upload from Node%d truncated to %d bytes\n",node&0x7f,maxlen);
+        len = maxlen;
+    }else if(crcon && sdo_crc(buf, len, 0) != ((fr.data[2]<<8)|fr.data[1])){
+        fprintf(stderr,"SDO block CRC error (Node%d)\n",node&0x7f);
+        sdo_abort(node, object, subindex, 0x05040004);
+        return -1;
+    }
+    memset(tdata, 0, 8);
+    tdata[0] = 0xA1; // end
+    if(!sdo_send(node, tdata)) return -1;
+    return len;
+}
+
+// sdoBlockUpload_() as one transaction
+int sdoBlockUpload(int node, int object, int subindex, unsigned char *buf, int maxlen){
+    sdo_begin(node);
+    int r = sdoBlockUpload_(node, object, subindex, buf, maxlen);
+    sdo_end(node);
+    return r;
+}
+
+// block download with CRC; return 1 if OK
+static int sdoBlockDownload_(int node, int object, int subindex, const unsigned char *buf, int len){
+    unsigned char tdata[8] = {0xC6, object&0xff, (object>>8)&0xff, subindex&0xff,
+                              len&0xff, (len>>8)&0xff, (len>>16)&0xff, (len>>24)&0xff};
+    can_rxframe fr;
+    int pos = 0, blksize;
+    unsigned short crc;
+    if(len < 1) return 0;
+    if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return 0;
+    if((fr.data[0] & 0xfb) != 0xA0 || !sdo_chkobj(&fr, object, subindex)){
+        fprintf(stderr,"Suspicious SDO block response from Node%d (func %02x)\n",node&0x7f,fr.data[0]);
+        sdo_abort(node, object, subindex, 0x05040001);
+        return 0;
+    }
+    blksize = fr.data[4];
+    while(pos < len){
+        int seq, start = pos;
+        if(blksize < 1 || blksize > 127){
+            sdo_abort(node, object, subindex, 0x05040002);
+            return 0;
+        }
+        can_tx_begin(); // send the sub-block by batches (full tx queue is waited in can_send_frames())
+        for(seq = 1; seq <= blksize && pos < len; ++seq){
+            int n = (len - pos > 7) ? 7 : len - pos;
+            memset(tdata, 0, 8);
+            tdata[0] = seq | ((pos + n == len) ? 0x80 : 0);
+            memcpy(&tdata[1], buf + pos, n);
+            pos += n;
+            can_send_frame(0x600 | (node&0x7f), 8, tdata);
+        }
+        sdotag[node&0x7f] = can_dtime();
+        if(!can_tx_flush() || !sdo_recv(node, &fr)) return 0;
+        if(fr.data[0] != 0xA2){
+            sdo_abort(node, object, subindex, 0x05040001);
+            return 0;
+        }
+        // server acknowledges last good segment: repeat the rest
+        pos = start + fr.data[1] * 7;
+        if(pos > len) pos = len;
+        blksize = fr.data[2];
+    }
+    // end: unused bytes in last segment & CRC
+    crc = sdo_crc(buf, len, 0);
+    memset(tdata, 0, 8);
+    tdata[0] = 0xC1 | (((7 - len % 7) % 7)<<2);
+    tdata[1] = crc&0xff; tdata[2] = crc>>8;
+    if(!sdo_send(node, tdata) || !sdo_recv(node, &fr)) return 0;
+    if(fr.data[0] != 0xA1){
+        fprintf(stderr,"Wrong end of SDO block download from Node%d\n",node&0x7f);
+        return 0;
+    }
+    return 1;
+}
+
+// sdoBlockDownload_() as one transaction
+int sdoBlockDownload(int node, int object, int subindex, const unsigned char *buf, int len){
+    sdo_begin(node);
+    int r = sdoBlockDownload_(node, object, subindex, buf, len);
+    sdo_end(node);
+    return r;
 }
 
 int setLong(int node, int object, int subindex, unsigned long value){
@@ -193,12 +864,13 @@ int saveObjects(int node){
     return doSDOdownload(node, 0x1010, 1, data, 0);
 }
 
-static unsigned char sdata[5] = {'\0'};
-char *getString(int node, int object, int subindex){
-    int dlen = doSDOupload(node, object, subindex, sdata);
-    if(dlen == 0) return NULL;
-    sdata[4] = '\0';
-    return (char*)sdata;
+// read string (visible string or domain) into buf of size buflen
+char *getString(int node, int object, int subindex, char *buf, int buflen){
+    if(buflen < 1) return NULL;
+    int dlen = sdoUpload(node, object, subindex, (unsigned char*)buf, buflen - 1);
+    if(dlen < 0) return NULL;
+    buf[dlen] = '\0';
+    return buf;
 }
 
 int getLong(int node, int object, int subindex, unsigned long *value){
@@ -231,11 +903,50 @@ int getByte(int node, int object, int subindex, unsigned char *value){
     return 1;
 }
 
+// read object of known type (from object dictionary); signed values are extended
+int getObject(int node, int object, int subindex, long *value){
+    const odobject *o = od_find(object, subindex);
+    unsigned char data[4] = {0};
+    if(o && o->access == OD_WO){
+        fprintf(stderr,"Object %04x/%d is write-only\n",object,subindex);
+        return 0;
+    }
+    int dlen = doSDOupload(node, object, subindex, data);
+    if(dlen == 0) return 0;
+    int size = od_size(o);
+    if(size && dlen != size)
+        fprintf(stderr,"Warning! Got %d bytes instead of %d from Node%d/%04x/%d\n",dlen,size,node,object,subindex);
+    unsigned long v = 0;
+    for(int i = dlen - 1; i >= 0; --i) v = (v << 8) | data[i];
+    if(od_signed(o) && dlen < 4 && (v & (1UL << (8*dlen - 1)))) v |= ~0UL << (8*dlen);
+    else if(od_signed(o) && dlen == 4) v = (unsigned long)(long)(int32_t)v;
+    *value = (long)v;
+    return 1;
+}
+
+// write object of known type (size is taken from object dictionary)
+int setObject(int node, int object, int subindex, long value){
+    const odobject *o = od_find(object, subindex);
+    int size = od_size(o);
+    if(!size){
+        fprintf(stderr,"Unknown size of object %04x/%d\n",object,subindex);
+        return 0;
+    }
+    if(o->access == OD_RO || o->access == OD_CONST){
+        fprintf(stderr,"Object %04x/%d is read-only\n",object,subindex);
+        return 0;
+    }
+    unsigned char data[4] = {0};
+    for(int i = 0; i < size; ++i, value >>= 8) data[i] = value & 0xff;
+    return doSDOdownload(node, object, subindex, data, size);
+}
+
 int sendSync(){
 // send broadcasting SYNC telegram
     unsigned long idt=0x80;
     int dlen=0;
     unsigned char tdata[1] = {0};
+    pdotag = can_dtime();
     return (can_send_frame(idt, dlen, tdata) > 0);
 }
 
@@ -243,22 +954,14 @@ int recvNextPDO(double tout, int *node, unsigned long *value){
 // wait up to 'tout' sec. for the one next PDO
 // if ok - return 1 for PDO1 or 2 for PDO2; else 0 if timeout
     double te = can_dtime()+tout;
-    int dlen=0, pdon = 0;
-    canid_t idr;
-    unsigned char rdata[8] = {0};
-    do{
-        while(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata)){
-            if(idr&CAN_RTR_FLAG) continue;
-            if((idr&0xf80) == 0x180) pdon=1;
-            else if((idr&0xf80) == 0x280) pdon=2;
-            if(pdon){
-                *node = idr&0x7f;
-                *value = (rdata[3]<<24)|(rdata[2]<<16)|(rdata[1]<<8)|rdata[0];
-                return pdon;
-            }
-        }
-        can_dsleep(0.02);
-    } while(can_dtime() < te);
+    int q = pdo_queue();
+    can_rxframe fr;
+    if(can_rx_wait_since(q, pdotag, te - can_dtime(), &fr)){
+        unsigned char *rdata = fr.data;
+        *node = fr.id&0x7f;
+        *value = (rdata[3]<<24)|(rdata[2]<<16)|(rdata[1]<<8)|rdata[0];
+        return ((fr.id&0xf80) == 0x180) ? 1 : 2;
+    }
     return 0;
 }
 
@@ -266,38 +969,28 @@ int recvPDOs(double tout, int maxpdo, int node[], int pdo_n[], unsigned long val
 // wait up to 'tout' sec. for the array of 'maxpdo' PDOs
 // if ok - return number of PDO really received; else 0 if timeout
     double te = can_dtime()+tout;
-    int npdo=0, dlen=0, pdon = 0;
-    canid_t idr;
-    unsigned char rdata[8] = {0};
-    do{
-        while(can_recv_frame(&rxpnt, &rxtime, &idr, &dlen, rdata)){
-            if(idr&CAN_RTR_FLAG) continue;
-            if((idr&0xf80) == 0x180) pdon=1;
-            else if((idr&0xf80) == 0x280) pdon=2;
-            else pdon = 0;
-            if(pdon){
-                node[npdo] = idr&0x7f;
-                pdo_n[npdo] = pdon;
-                switch(dlen){
-                    case 1:
-                        value[npdo] = rdata[0];
-                    break;
-                    case 2:
-                        value[npdo] = (rdata[1]<<8)|rdata[0];
-                    break;
-                    case 3:
-                        value[npdo] = (rdata[2]<<16)|(rdata[1]<<8)|rdata[0];
-                    break;
-                    default:
-                        value[npdo] = (rdata[3]<<24)|(rdata[2]<<16)|(rdata[1]<<8)|rdata[0];
-                    break;
-                }
-                npdo++;
-                if(npdo>=maxpdo) return npdo;
-            }
+    int npdo=0, q = pdo_queue();
+    can_rxframe fr;
+    while(npdo < maxpdo && can_rx_wait_since(q, pdotag, te - can_dtime(), &fr)){
+        unsigned char *rdata = fr.data;
+        node[npdo] = fr.id&0x7f;
+        pdo_n[npdo] = ((fr.id&0xf80) == 0x180) ? 1 : 2;
+        switch(fr.len){
+            case 1:
+                value[npdo] = rdata[0];
+            break;
+            case 2:
+                value[npdo] = (rdata[1]<<8)|rdata[0];
+            break;
+            case 3:
+                value[npdo] = (rdata[2]<<16)|(rdata[1]<<8)|rdata[0];
+            break;
+            default:
+                value[npdo] = (rdata[3]<<24)|(rdata[2]<<16)|(rdata[1]<<8)|rdata[0];
+            break;
         }
-        can_dsleep(0.02);
-    } while(can_dtime() < te && npdo < maxpdo);
+        npdo++;
+    }
     return npdo;
 }
 
@@ -307,13 +1000,9 @@ int requestPDO(double tout, int node, int pdon, unsigned long *value){
     unsigned long idt = (((pdon==1)?0x180:0x280)|(node&0x7f)|CAN_RTR_FLAG);
     int dlen=0, rnode;
     unsigned char dummy[1];
-    can_clean_recv(&rxpnt, &rxtime);
+    pdotag = can_dtime();
     if(can_send_frame(idt, dlen, dummy) <= 0) return 0;
-    can_dsleep(0.01);
     if(recvNextPDO(tout, &rnode, value) == pdon) return 1;
     return 0;
 }
 
-void clean_recv(){
-    can_clean_recv(&rxpnt, &rxtime);
-}
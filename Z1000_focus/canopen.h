@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include "can_io.h"
+#include "rtt.h"
 
 #define startNode(Node) sendNMT(Node,1) // put node in "Operational" mode
 #define stopNode(Node) sendNMT(Node,2)  // put node in "Stop" mode
@@ -19,26 +20,73 @@
 #define NodeOperational 5
 #define NodePreOperational 0x7f
 
-void clean_recv();
+// asynchronous SDO request
+typedef enum{
+    SDO_PENDING = 0,    // sent or waiting for previous request to the same node
+    SDO_DONE,
+    SDO_ABORTED,        // abort code in `abortcode`
+    SDO_TIMEOUT,
+    SDO_ERROR           // unexpected answer
+} sdo_status;
+
+typedef struct sdo_req sdo_req;
+typedef void (*sdo_cb)(sdo_req *r, void *arg);
+struct sdo_req{
+    int node;
+    int object;
+    int subindex;
+    int write;                  // 1 - expedited download, 0 - upload
+    unsigned char data[4];      // data to write or got
+    int len;                    // its length
+    volatile sdo_status status;
+    unsigned long abortcode;
+    double rtt;                 // time between request and answer, s
+    struct timespec ts;         // kernel receive time of answer
+    sdo_cb cb;                  // completion callback (could be NULL)
+    void *arg;
+    // private
+    double tsent;
+    sdo_status result;          // answer got by receive thread (or timeout)
+    volatile int incb;          // callback is running
+    sdo_req *next;
+};
+
 int initNode(int node);
 int sendNMT(int node, int icode);
 int resetNode2(int oldnode, int newnode);
 int resetNode(int node);
 int getNodeState(int node);
+int setHeartbeat(int node, int ms);
+int consumeHeartbeat(int node, int ms);
+int heartbeatLost(int node);
 int initNode(int node);
 int sendSDOdata(int node, int func, int object, int subindex, unsigned char data[]);
 int sendSDOreq(int node, int object, int subindex);
 int recvSDOresp(int node, int t_func, int t_object, int t_subindex, unsigned char data[]);
+void SDOrxtime(int node, struct timespec *ts);
+rttstat *sdoRTT(int node);
 int doSDOdownload(int node, int object, int subindex, unsigned char data[], int dlen);
 int doSDOupload(int node, int object, int subindex, unsigned char data[]);
 int setLong(int node, int object, int subindex, unsigned long value);
 int setShort(int node, int object, int subindex, unsigned short value);
 int setByte(int node, int object, int subindex, unsigned char value);
 int saveObjects(int node);
-char *getString(int node, int object, int subindex);
+char *getString(int node, int object, int subindex, char *buf, int buflen);
+int sdoUpload(int node, int object, int subindex, unsigned char *buf, int maxlen);
+int sdoDownload(int node, int object, int subindex, const unsigned char *buf, int len);
+int sdoBlockUpload(int node, int object, int subindex, unsigned char *buf, int maxlen);
+int sdoBlockDownload(int node, int object, int subindex, const unsigned char *buf, int len);
+int sdoSubmit(sdo_req *r);
+int sdoGetAsync(sdo_req *r, int node, int object, int subindex, sdo_cb cb, void *arg);
+int sdoSetAsync(sdo_req *r, int node, int object, int subindex, unsigned long value, int len, sdo_cb cb, void *arg);
+int sdoWait(sdo_req *r);
+int sdoWaitAll(sdo_req r[], int n);
+unsigned long sdoValue(const sdo_req *r);
 int getLong(int node, int object, int subindex, unsigned long *value);
 int getShort(int node, int object, int subindex, unsigned short *value);
 int getByte(int node, int object, int subindex, unsigned char *value);
+int getObject(int node, int object, int subindex, long *value);
+int setObject(int node, int object, int subindex, long value);
 int sendSync();
 int recvNextPDO(double tout, int *node, unsigned long *value);
 int recvPDOs(double tout, int maxpdo, int node[], int pdo_n[], unsigned long value[]);
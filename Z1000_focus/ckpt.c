@@ -0,0 +1,115 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ckpt.h"
+#include "usefull_macros.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static ckptstate *state = NULL;
+static pthread_mutex_t ckptmtx = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief ckpt_open - map state file (created if absent); file should belong
+ *          to this user and be writeable by owner only
+ * @param name - file name
+ * @return 0 if all OK
+ */
+int ckpt_open(const char *name){
+    if(state) return 0;
+    struct stat st;
+    int fd = open(name, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if(fd < 0){
+        WARN("open(%s)", name);
+        return 1;
+    }
+    if(fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))){
+        WARNX("%s: foreign state file, ignore it", name);
+        close(fd);
+        return 1;
+    }
+    if(ftruncate(fd, sizeof(ckptstate))){
+        WARN("ftruncate()");
+        close(fd);
+        return 1;
+    }
+    void *m = mmap(NULL, sizeof(ckptstate), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(m == MAP_FAILED){
+        WARN("mmap()");
+        return 1;
+    }
+    state = (ckptstate*)m;
+    return 0;
+}
+
+/**
+ * @brief ckpt_load - get consistent copy of stored state
+ * @param s (o) - state
+ * @return 1 if state is valid
+ */
+int ckpt_load(ckptstate *s){
+    if(!state) return 0;
+    for(int i = 0; i < 3; ++i){ // writer could be killed in the middle of update
+        uint32_t seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE);
+        *s = *state;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(seq & 1 || seq != __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE)) continue;
+        return (s->magic == CKPT_MAGIC && s->version == CKPT_VERSION);
+    }
+    return 0;
+}
+
+/**
+ * @brief ckpt_sameboot - check if state was written after system boot (so hardware
+ *          state in it could be actual; calibrations are valid anyway)
+ * @param s - state
+ * @return 1 if written after boot
+ */
+int ckpt_sameboot(const ckptstate *s){
+    struct timespec ts;
+    if(clock_gettime(CLOCK_BOOTTIME, &ts)) return 0;
+    return (s->wtime > dtime() - ts.tv_sec - ts.tv_nsec * 1e-9);
+}
+
+/**
+ * @brief ckpt_begin - start state update (should be finished by ckpt_end())
+ * @return pointer to state or NULL if there's no state file
+ */
+ckptstate *ckpt_begin(){
+    if(!state) return NULL;
+    pthread_mutex_lock(&ckptmtx);
+    __atomic_store_n(&state->seq, state->seq | 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return state;
+}
+
+// finish state update
+void ckpt_end(){
+    if(!state) return;
+    state->magic = CKPT_MAGIC;
+    state->version = CKPT_VERSION;
+    state->wtime = dtime();
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ckptmtx);
+}
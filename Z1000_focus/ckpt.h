@@ -0,0 +1,63 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef CKPT_H__
+#define CKPT_H__
+
+#include <stdint.h>
+#include "rls.h"
+
+#define CKPT_MAGIC      (0x5a31464b)
+// change it on any change of `ckptstate`
+#define CKPT_VERSION    (3)
+// bins of move duration histogram: bin i for distances [2^i, 2^(i+1)) encoder's counts
+#define MOVEHIST_NBINS  (20)
+
+// controller's state stored in memory-mapped file (survives child's restart)
+typedef struct{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seq;           // odd while writing
+    int encnode;            // encoder's node ID
+    int motaddr;            // motor's address
+    int pdoperiod;          // position PDO period, ms (0 - SDO or SYNC)
+    int speedon;            // speed PDO is on
+    double syncfreq;        // SYNC frequency (PDOs are sent on SYNC if >0)
+    double wtime;           // time of last write (UNIX time)
+    long position;          // last encoder's position
+    int status;             // last status (sysstatus)
+    int moving;             // motor was commanded to move
+    double target;          // target of move2pos() (NAN if none)
+    int16_t targspd;        // last speed setpoint (raw)
+    double corr[RLS_NPAR];  // stopping coefficients CORR0..CORR2 (estimated by stops)
+    double corrP[RLS_NPAR][RLS_NPAR]; // their covariance
+    unsigned long corrn;    // amount of stops used for estimation (0 - default coefficients)
+    double corrrms;         // RMS of stopping distance residuals
+    unsigned long histn[MOVEHIST_NBINS];    // amount of moves by distance
+    double histT[MOVEHIST_NBINS];           // their mean duration, s
+    double histratio[MOVEHIST_NBINS];       // mean ratio of duration to predicted by model
+} ckptstate;
+
+int ckpt_open(const char *name);
+int ckpt_load(ckptstate *s);
+int ckpt_sameboot(const ckptstate *s);
+ckptstate *ckpt_begin();
+void ckpt_end();
+
+#endif // CKPT_H__
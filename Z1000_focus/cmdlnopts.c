@@ -26,6 +26,7 @@
 #include "cmdlnopts.h"
 #include "usefull_macros.h"
 #include "socket.h"
+#include "HW_dependent.h"
 
 /*
  * here are global parameters initialisation
@@ -34,6 +35,8 @@ int help;
 glob_pars  GP;
 
 #define DEFPIDNAME "/tmp/z1000focus.pid"
+#define DEFCANDEV  "can1"
+#define DEFSTATEFILE "/var/tmp/z1000focus.state"
 
 //            DEFAULTS
 // default global parameters
@@ -43,7 +46,12 @@ glob_pars const Gdefault = {
     .gotopos = NAN,
     .port = DEFPORT,
     .pidfilename = DEFPIDNAME,
-    .chpresetval = -1
+    .chpresetval = -1,
+    .candev = DEFCANDEV,
+    .pdoperiod = PDO_PERIOD,
+    .curderate = CURRENT_DERATE,
+    .curstop = CURRENT_STOP,
+    .statefile = DEFSTATEFILE
 };
 
 /*
@@ -61,6 +69,8 @@ myoption cmdlnopts[] = {
     {"targspeed",NEED_ARG,  NULL,   't',    arg_double, APTR(&GP.targspeed), "move motor with constant speed (rev/min)"},
     {"stop",    NO_ARGS,    NULL,   's',    arg_none,   APTR(&GP.stop),      "stop motor"},
     {"monitor", NEED_ARG,   NULL,   'm',    arg_double, APTR(&GP.monitspd),  "move a little with given speed with monitoring"},
+    {"bench",   NEED_ARG,   NULL,   'B',    arg_double, APTR(&GP.benchspan), "benchmark moves between points over given span (mm) with & without speed law"},
+    {"speedlaw",NO_ARGS,    NULL,   'L',    arg_none,   APTR(&GP.speedlaw),  "limit speed by remaining distance instead of planned deceleration"},
     {"eswstate",NO_ARGS,    NULL,   'e',    arg_none,   APTR(&GP.showesw),   "show end-switches state"},
     {"logfile", NEED_ARG,   NULL,   'l',    arg_string, APTR(&GP.logname),   "logfile name and path"},
     {"server",  NO_ARGS,    NULL,   'S',    arg_none,   APTR(&GP.server),    "work as server"},
@@ -72,6 +82,18 @@ myoption cmdlnopts[] = {
     {"nomotor", NO_ARGS,    NULL,   'M',    arg_none,   APTR(&GP.nomotor),   "don't initialize motor"},
     {"noencoder",NO_ARGS,   NULL,   'E',    arg_none,   APTR(&GP.noencoder), "don't initialize encoder"},
     {"focout",  NEED_ARG,   NULL,   'f',    arg_string, APTR(&GP.focfilename),"filename where to store focus data"},
+    {"candev",  NEED_ARG,   NULL,   'd',    arg_string, APTR(&GP.candev),    "CAN interface name (default: " DEFCANDEV ")"},
+    {"pdoperiod",NEED_ARG,  NULL,   'T',    arg_int,    APTR(&GP.pdoperiod), "period of position PDO, ms (default: 2, 0 - read position by SDO)"},
+    {"encspeed",NO_ARGS,    NULL,   'U',    arg_none,   APTR(&GP.encspeed),  "use speed measured by encoder (PDO2) instead of motor's"},
+    {"syncfreq",NEED_ARG,   NULL,   'Y',    arg_double, APTR(&GP.syncfreq),  "produce SYNC with given frequency (Hz) and acquire data on it"},
+    {"curderate",NEED_ARG,  NULL,   'c',    arg_double, APTR(&GP.curderate), "motor's current to derate speed while moving (% of nominal)"},
+    {"curstop", NEED_ARG,   NULL,   'C',    arg_double, APTR(&GP.curstop),   "motor's current to stop moving (% of nominal)"},
+    {"eds",     NEED_ARG,   NULL,   'D',    arg_string, APTR(&GP.edsfile),   "encoder's EDS file (types and access modes of objects)"},
+    {"statefile",NEED_ARG,  NULL,   'k',    arg_string, APTR(&GP.statefile), "state file: stopping model, move durations & state for warm restart (default: " DEFSTATEFILE ")"},
+    {"warmstart",NO_ARGS,   NULL,   'W',    arg_none,   APTR(&GP.warmstart), "resume after child's restart by state file instead of full init"},
+    {"cfgsave", NEED_ARG,   NULL,   'o',    arg_string, APTR(&GP.cfgsave),   "backup encoder's configuration into file"},
+    {"cfgload", NEED_ARG,   NULL,   'O',    arg_string, APTR(&GP.cfgload),   "restore encoder's configuration from file (made by --cfgsave)"},
+    {"nofilter",NO_ARGS,    NULL,   'F',    arg_none,   APTR(&GP.nofilter),  "don't set kernel CAN filters (receive all frames)"},
     end_option
 };
 
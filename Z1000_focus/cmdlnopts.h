@@ -35,6 +35,8 @@ typedef struct{
     double targspeed;       // just rotate motor with given speed
     int stop;               // stop motor
     double monitspd;        // start speed monitoring (for dynamics)
+    double benchspan;       // span of move benchmark points (mm)
+    int speedlaw;           // limit speed by remaining distance
     int showesw;            // show end-switches state
     char *logname;          // logfile name & path
     int server;             // work as server
@@ -46,6 +48,18 @@ typedef struct{
     int nomotor;            // don't check and even try to use motor
     int noencoder;          // don't check and even try to use encoder
     char *focfilename;      // name of file with focus data
+    int nofilter;           // don't use kernel CAN filters
+    char *candev;           // CAN interface name
+    int pdoperiod;          // period of encoder's position PDO (ms), 0 - use SDO
+    int encspeed;           // stream encoder's speed by PDO2 and use it instead of motor's
+    double syncfreq;        // frequency of SYNC producer (Hz), 0 - don't produce SYNC
+    double curderate;       // motor's current to derate speed (% of nominal)
+    double curstop;         // motor's current to stop motion (% of nominal)
+    char *edsfile;          // encoder's EDS file (object types & access modes)
+    char *statefile;        // memory-mapped state checkpoint (calibrations & state for warm restart)
+    int warmstart;          // resume by checkpoint after restart
+    char *cfgsave;          // file to backup encoder's configuration
+    char *cfgload;          // file to restore encoder's configuration from
 } glob_pars;
 
 
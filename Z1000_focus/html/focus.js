@@ -49,8 +49,8 @@ function btnsStat(moving){
 }
 // parse answer for status request
 function chkStatus(req){
-    var msg = req.responseText;
-    Log("Get status message: " + msg);
+    var msg = req.responseText.split('\n')[0]; // "moving" may be followed by eta & progress
+    Log("Get status message: " + req.responseText);
     if(msg == "OK" || msg == "moving"){
         $("shadow").innerHTML = "";
         $("shadow").style.display = "none";
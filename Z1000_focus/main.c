@@ -25,6 +25,8 @@
 #include "can_encoder.h"
 #include "canopen.h"
 #include "checkfile.h"
+#include "ckpt.h"
+#include "objdict.h"
 #include "cmdlnopts.h"
 #include "HW_dependent.h"
 #include "socket.h"
@@ -90,7 +92,18 @@ int main (int argc, char *argv[]){
 
     signal(SIGTSTP, SIG_IGN);
     signal(SIGHUP, SIG_IGN);
-    can_dev[8] = '1';
+    snprintf(can_dev, sizeof(can_dev), "/dev/%s", G->candev);
+    if(G->nofilter) can_set_filtering(0);
+    if(set_sync(G->syncfreq)) return 1;
+    if(set_curlimits(G->curderate, G->curstop)) return 1;
+    set_speedlaw(G->speedlaw);
+    // calibrations are kept in state file by server & standalone
+    if(G->statefile && (G->server || G->standalone) && ckpt_open(G->statefile)) G->statefile = NULL;
+    if(G->edsfile){
+        int n = od_load_eds(G->edsfile);
+        if(n < 0) WARN("Can't read EDS file %s", G->edsfile);
+        else verbose("Got %d objects from %s\n", n, G->edsfile);
+    }
 
     if(G->server){ // daemonize & run server
     /*
@@ -103,22 +116,33 @@ int main (int argc, char *argv[]){
         check4running(G->pidfilename);
 #ifndef EBUG
         while(1){ // guard for dead processes
+            double tstart = dtime();
             pid_t childpid = fork();
             if(childpid){
                 DBG("child: %d", childpid);
                 wait(NULL);
                 DBG("child: %d DIED", childpid);
-                sleep(1);
+                // restart at once if child worked for a while, else don't spin on dead hardware
+                if(dtime() - tstart < CHILD_MINLIFE) sleep(1);
+                else usleep(CHILD_RESTART_DELAY);
             }else{
                 prctl(PR_SET_PDEATHSIG, SIGTERM); // send SIGTERM to child when parent dies
-                if(G->server || G->standalone){ // init hardware
-                    if(!G->noencoder && init_encoder(G->nodenum, G->reset)) ERRX("Encoder not found");
-                    if(!G->nomotor && init_motor_ids(G->motorID)) ERRX("Error during motor initialization");
-                }
                 if(G->logname){ // open log file in child
                     openlogfile(G->logname);
                     putlog("created child with PID %d", getpid());
                 }
+                if(G->server || G->standalone){ // init hardware: resume from checkpoint or full init
+                    int warm = (G->warmstart && G->statefile && !G->noencoder && !G->nomotor &&
+                                !G->reset && !warm_init(G->nodenum, G->motorID));
+                    if(!warm) switch(init_devices(G->noencoder ? -1 : G->nodenum, G->reset, G->pdoperiod, G->encspeed,
+                                        G->nomotor ? -1 : G->motorID)){
+                        case 1: ERRX("Encoder not found");
+                        break;
+                        case 2: ERRX("Error during motor initialization");
+                        break;
+                        default: break;
+                    }
+                }
                 daemonize(G->port);
             }
         }
@@ -136,13 +160,14 @@ int main (int argc, char *argv[]){
 
     check4running(G->pidfilename);
 
-    if(!G->noencoder && init_encoder(G->nodenum, G->reset)){
+    int initret = init_devices(G->noencoder ? -1 : G->nodenum, G->reset, G->pdoperiod, G->encspeed,
+                               G->nomotor ? -1 : G->motorID);
+    if(initret == 1){
         WARNX("Encoder not found");
 #ifndef EBUG
         return 1;
 #endif
-    }
-    if(!G->nomotor && init_motor_ids(G->motorID)){
+    }else if(initret == 2){
         WARNX("Error during motor initialization");
         ret = 1;
 #ifndef EBUG
@@ -155,11 +180,22 @@ int main (int argc, char *argv[]){
         goto Oldcond;
     }else verbose("Position @ start: %.2fmm\n", curposition);
 
+    if(G->cfgsave || G->cfgload){ // configuration backup/restore
+        if(G->cfgsave && enc_cfgsave(G->cfgsave)) ret = 1;
+        if(G->cfgload && enc_cfgload(G->cfgload)) ret = 1;
+        goto Oldcond;
+    }
+
     if(fabs(G->monitspd) > DBL_EPSILON){
         movewithmon(G->monitspd);
         goto Oldcond;
     }
 
+    if(G->benchspan > 0.){
+        movebench(G->benchspan);
+        goto Oldcond;
+    }
+
     if(G->stop){ // Stop motor
         if(stop()) ret = 1;
         goto Oldcond;
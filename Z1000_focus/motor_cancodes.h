@@ -87,6 +87,12 @@
 #define PAR_SPD_IDX     8318
 // 0x2086 - current
 #define PAR_CRNT_IDX    8326
+// process data description: 0x2074, 0x2075 - PI2, PI3 actual values (P874, P875)
+#define PAR_PI2DESC_IDX 8308
+#define PAR_PI3DESC_IDX 8309
+// descriptions:
+#define PI_SPEED        1
+#define PI_CURRENT      2
 // inputs role
 // 0x228c - DI0
 #define PAR_DI00_IDX    8844
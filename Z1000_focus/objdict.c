@@ -0,0 +1,268 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "DS406_canopen.h"
+#include "objdict.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> // strcasecmp
+
+// built-in model of encoder's dictionary (extended or overriden by EDS)
+static odobject OD[OD_MAXOBJ] = {
+    {DS406_DEVTYPE,         0, OD_UINT32, OD_RO, 0, 1},
+    {DS406_ERRORREG,        0, OD_UINT8,  OD_RO, 1, 0},
+    {DS406_MANDEVNAME,      0, OD_VISSTRING, OD_CONST, 0, 1},
+    {DS406_MANHW_VERS,      0, OD_VISSTRING, OD_CONST, 0, 1},
+    {DS406_MANSW_VERS,      0, OD_VISSTRING, OD_CONST, 0, 1},
+    {DS406_STORE_PARAMS,    1, OD_UINT32, OD_RW, 0, 0},
+    {DS406_RESTORE_DEF,     1, OD_UINT32, OD_RW, 0, 0},
+    {DS406_PROD_HEARTB_TM,  0, OD_UINT16, OD_RW, 0, 0},
+    {DS406_IDENT_OBJ,       1, OD_UINT32, OD_RO, 0, 1},
+    {DS406_IDENT_OBJ,       2, OD_UINT32, OD_RO, 0, 1},
+    {DS406_IDENT_OBJ,       3, OD_UINT32, OD_RO, 0, 1},
+    {DS406_IDENT_OBJ,       4, OD_UINT32, OD_RO, 0, 1},
+    {DS406_PDO1,            1, OD_UINT32, OD_RW, 0, 0},
+    {DS406_PDO1,            2, OD_UINT8,  OD_RW, 0, 0},
+    {DS406_PDO1,            5, OD_UINT16, OD_RW, 0, 0},
+    {DS406_PDO2,            1, OD_UINT32, OD_RW, 0, 0},
+    {DS406_PDO2,            2, OD_UINT8,  OD_RW, 0, 0},
+    {DS406_PDO2,            5, OD_UINT16, OD_RW, 0, 0},
+    {DS406_PDO1_MAPPED,     0, OD_UINT8,  OD_RW, 0, 0},
+    {DS406_PDO1_MAPPED,     1, OD_UINT32, OD_RW, 0, 0},
+    {DS406_PDO2_MAPPED,     0, OD_UINT8,  OD_RW, 0, 0},
+    {DS406_PDO2_MAPPED,     1, OD_UINT32, OD_RW, 0, 0},
+    {DS406_CUSTOMER_MEMRY,  0, OD_DOMAIN, OD_RW, 0, 0},
+    {DS406_CONF_PARAMETERS, 1, OD_UINT16, OD_RW, 0, 0},
+    {DS406_CONF_PARAMETERS, 2, OD_UINT32, OD_RW, 0, 0},
+    {DS406_CONF_PARAMETERS, 3, OD_UINT32, OD_RW, 0, 0},
+    {DS406_CONF_VALID,      0, OD_UINT8,  OD_RW, 0, 0},
+    {DS406_POSITION_VAL,    0, OD_UINT32, OD_RO, 1, 0},
+    {DS406_SPEED_VAL,       1, OD_INT16,  OD_RO, 1, 0},
+    {DS406_CYCLE_TIMER,     0, OD_UINT16, OD_RW, 0, 0},
+    {DS406_TURN_RESOLUT,    0, OD_UINT32, OD_RO, 0, 1},
+    {DS406_REVOL_NUMBER,    0, OD_UINT16, OD_RO, 0, 1},
+    {DS406_ALARMS,          0, OD_UINT16, OD_RO, 1, 0},
+    {DS406_SUPP_ALARMS,     0, OD_UINT16, OD_RO, 0, 1},
+    {DS406_WARNINGS,        0, OD_UINT16, OD_RO, 1, 0},
+    {DS406_SUPP_WARNINGS,   0, OD_UINT16, OD_RO, 0, 1},
+    {DS406_PROF_SW_VERS,    0, OD_UINT32, OD_RO, 0, 1},
+    {DS406_SERIAL_NUMBER,   0, OD_UINT32, OD_RO, 0, 1},
+};
+static int ODn = -1; // amount of objects (counted at first use)
+
+// count built-in objects
+static void od_init(){
+    if(ODn > -1) return;
+    for(ODn = 0; ODn < OD_MAXOBJ && OD[ODn].idx; ++ODn);
+}
+
+// cached values of static objects
+static struct{
+    int node;
+    uint16_t idx;
+    uint8_t subidx;
+    uint8_t len;
+    unsigned char data[4];
+} cache[OD_CACHESZ];
+static int ncached = 0;
+static pthread_mutex_t cachemtx = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief od_find - find object in dictionary
+ * @param idx    - index
+ * @param subidx - subindex
+ * @return pointer to object or NULL if not found
+ */
+const odobject *od_find(int idx, int subidx){
+    od_init();
+    for(int i = 0; i < ODn; ++i)
+        if(OD[i].idx == idx && OD[i].subidx == subidx) return &OD[i];
+    return NULL;
+}
+
+/**
+ * @brief od_get - enumerate dictionary
+ * @param i - number of object
+ * @return pointer to i-th object or NULL if there's no such
+ */
+const odobject *od_get(int i){
+    od_init();
+    if(i < 0 || i >= ODn) return NULL;
+    return &OD[i];
+}
+
+/**
+ * @brief od_size - size of object's value
+ * @param o - object
+ * @return size in bytes or 0 for strings/domains
+ */
+int od_size(const odobject *o){
+    if(!o) return 0;
+    switch(o->type){
+        case OD_BOOLEAN:
+        case OD_INT8:
+        case OD_UINT8: return 1;
+        case OD_INT16:
+        case OD_UINT16: return 2;
+        case OD_INT32:
+        case OD_UINT32: return 4;
+        default: return 0;
+    }
+}
+
+// return 1 if object has signed type
+int od_signed(const odobject *o){
+    if(!o) return 0;
+    return (o->type == OD_INT8 || o->type == OD_INT16 || o->type == OD_INT32);
+}
+
+/**
+ * @brief od_cache_get - get cached value
+ * @param node     - node ID
+ * @param idx      - index
+ * @param subidx   - subindex
+ * @param data (o) - value
+ * @return data length or 0 if there's no cached value
+ */
+int od_cache_get(int node, int idx, int subidx, unsigned char data[4]){
+    int len = 0;
+    pthread_mutex_lock(&cachemtx);
+    for(int i = 0; i < ncached; ++i)
+        if(cache[i].node == node && cache[i].idx == idx && cache[i].subidx == subidx){
+            memcpy(data, cache[i].data, 4);
+            len = cache[i].len;
+            break;
+        }
+    pthread_mutex_unlock(&cachemtx);
+    return len;
+}
+
+/**
+ * @brief od_cache_put - store value of static object (others are ignored)
+ * @param node   - node ID
+ * @param idx    - index
+ * @param subidx - subindex
+ * @param data   - value
+ * @param len    - its length
+ */
+void od_cache_put(int node, int idx, int subidx, const unsigned char data[4], int len){
+    const odobject *o = od_find(idx, subidx);
+    if(!o || !o->stat || len < 1 || len > 4) return;
+    pthread_mutex_lock(&cachemtx);
+    if(ncached < OD_CACHESZ){
+        cache[ncached].node = node;
+        cache[ncached].idx = idx;
+        cache[ncached].subidx = subidx;
+        cache[ncached].len = len;
+        memcpy(cache[ncached].data, data, 4);
+        ++ncached;
+    }
+    pthread_mutex_unlock(&cachemtx);
+}
+
+/**
+ * @brief od_invalidate - forget cached values (after node reset)
+ * @param node - node ID (0 - all nodes)
+ */
+void od_invalidate(int node){
+    pthread_mutex_lock(&cachemtx);
+    for(int i = 0; i < ncached;){
+        if(node == 0 || cache[i].node == node) cache[i] = cache[--ncached];
+        else ++i;
+    }
+    pthread_mutex_unlock(&cachemtx);
+}
+
+// add object or replace existing one
+static void od_add(const odobject *o){
+    od_init();
+    for(int i = 0; i < ODn; ++i)
+        if(OD[i].idx == o->idx && OD[i].subidx == o->subidx){
+            // static objects of built-in model stay static
+            int stat = OD[i].stat;
+            OD[i] = *o;
+            if(stat && OD[i].access != OD_RW && OD[i].access != OD_WO) OD[i].stat = 1;
+            return;
+        }
+    if(ODn < OD_MAXOBJ) OD[ODn++] = *o;
+}
+
+/**
+ * @brief od_load_eds - load object types & access modes from EDS file
+ *          (only `const` objects and built-in static ones would be cached)
+ * @param name - file name
+ * @return amount of objects loaded or -1 if can't open file
+ */
+int od_load_eds(const char *name){
+    FILE *f = fopen(name, "r");
+    if(!f) return -1;
+    char line[256];
+    odobject o = {0};
+    int insect = 0, hastype = 0, n = 0;
+    while(1){
+        char *l = fgets(line, sizeof(line), f);
+        char *s = l;
+        if(s){
+            while(isspace(*s)) ++s;
+            char *e = s + strlen(s);
+            while(e > s && isspace(e[-1])) *--e = 0;
+        }
+        if(!s || *s == '['){ // new section: store previous object
+            if(insect && hastype){
+                od_add(&o);
+                ++n;
+            }
+            if(!s) break;
+            unsigned int idx, sub = 0;
+            char c;
+            insect = 0; hastype = 0;
+            memset(&o, 0, sizeof(o));
+            if(sscanf(s, "[%4x%c", &idx, &c) == 2 && (c == ']' || ((c == 's' || c == 'S') &&
+               sscanf(s + 5, "%*[subSUB]%x]", &sub) == 1))){
+                o.idx = idx;
+                o.subidx = sub;
+                insect = 1;
+            }
+            continue;
+        }
+        if(!insect || *s == ';') continue;
+        char *eq = strchr(s, '=');
+        if(!eq) continue;
+        *eq++ = 0;
+        char *k = s + strlen(s);
+        while(k > s && isspace(k[-1])) *--k = 0;
+        while(isspace(*eq)) ++eq;
+        if(strcasecmp(s, "DataType") == 0){
+            o.type = strtol(eq, NULL, 0);
+            hastype = 1;
+        }else if(strcasecmp(s, "AccessType") == 0){
+            if(strcasecmp(eq, "const") == 0){ o.access = OD_CONST; o.stat = 1; }
+            else if(strcasecmp(eq, "ro") == 0) o.access = OD_RO;
+            else if(strcasecmp(eq, "wo") == 0) o.access = OD_WO;
+            else o.access = OD_RW; // rw, rwr, rww
+        }else if(strcasecmp(s, "PDOMapping") == 0){
+            o.pdomap = (strtol(eq, NULL, 0) != 0);
+        }
+    }
+    fclose(f);
+    od_invalidate(0);
+    return n;
+}
@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef OBJDICT_H__
+#define OBJDICT_H__
+
+#include <stdint.h>
+
+// data types (CiA 301)
+#define OD_BOOLEAN      0x0001
+#define OD_INT8         0x0002
+#define OD_INT16        0x0003
+#define OD_INT32        0x0004
+#define OD_UINT8        0x0005
+#define OD_UINT16       0x0006
+#define OD_UINT32       0x0007
+#define OD_VISSTRING    0x0009
+#define OD_DOMAIN       0x000F
+
+// max amount of objects in dictionary
+#define OD_MAXOBJ       512
+// max amount of cached values
+#define OD_CACHESZ      64
+
+typedef enum{
+    OD_RO,
+    OD_WO,
+    OD_RW,
+    OD_CONST
+} odaccess;
+
+// object dictionary entry
+typedef struct{
+    uint16_t idx;
+    uint8_t subidx;
+    uint16_t type;      // data type
+    odaccess access;
+    uint8_t pdomap;     // could be mapped into PDO
+    uint8_t stat;       // value never changes (till reset): cache it after the first read
+} odobject;
+
+int od_load_eds(const char *name);
+const odobject *od_find(int idx, int subidx);
+const odobject *od_get(int i);
+int od_size(const odobject *o);
+int od_signed(const odobject *o);
+int od_cache_get(int node, int idx, int subidx, unsigned char data[4]);
+void od_cache_put(int node, int idx, int subidx, const unsigned char data[4], int len);
+void od_invalidate(int node);
+
+#endif // OBJDICT_H__
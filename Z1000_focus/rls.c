@@ -0,0 +1,165 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rls.h"
+#include <math.h>
+#include <stdio.h>
+
+// regressor for scaled x
+static void regressor(rlsmodel *m, double x, double *phi){
+    double u = x / m->xscale;
+    phi[0] = 1.;
+    for(int i = 1; i < RLS_NPAR; ++i) phi[i] = phi[i-1] * u;
+}
+
+/**
+ * @brief rls_init - set initial coefficients & their diagonal covariance
+ * @param m      - model
+ * @param c      - coefficients c0..c2 (for unscaled x)
+ * @param xscale - scale of x
+ * @param lambda - forgetting factor
+ * @param p0     - initial variance of scaled coefficients
+ */
+void rls_init(rlsmodel *m, const double *c, double xscale, double lambda, double p0){
+    pthread_mutex_lock(&m->mtx);
+    m->xscale = xscale;
+    m->lambda = lambda;
+    m->p0 = p0;
+    double s = 1.;
+    for(int i = 0; i < RLS_NPAR; ++i){
+        m->th[i] = c[i] * s;
+        s *= xscale;
+        for(int j = 0; j < RLS_NPAR; ++j) m->P[i][j] = (i == j) ? p0 : 0.;
+    }
+    m->n = m->nrej = 0;
+    m->lastres = m->rms = 0.;
+    pthread_mutex_unlock(&m->mtx);
+}
+
+// model value @ x
+double rls_predict(rlsmodel *m, double x){
+    double phi[RLS_NPAR], y = 0.;
+    regressor(m, x, phi);
+    pthread_mutex_lock(&m->mtx);
+    for(int i = 0; i < RLS_NPAR; ++i) y += m->th[i] * phi[i];
+    pthread_mutex_unlock(&m->mtx);
+    return y;
+}
+
+/**
+ * @brief rls_update - add new sample
+ * @param m      - model
+ * @param x, y   - sample
+ * @param maxres - samples with residual larger than maxres + 3*RMS are rejected
+ * @return 1 if sample is used
+ */
+int rls_update(rlsmodel *m, double x, double y, double maxres){
+    double phi[RLS_NPAR], Pphi[RLS_NPAR], k[RLS_NPAR], e = y, d;
+    regressor(m, x, phi);
+    pthread_mutex_lock(&m->mtx);
+    for(int i = 0; i < RLS_NPAR; ++i) e -= m->th[i] * phi[i];
+    m->lastres = e;
+    if(m->n >= RLS_MINSAMPLES && fabs(e) > maxres + 3.*m->rms){
+        ++m->nrej;
+        pthread_mutex_unlock(&m->mtx);
+        return 0;
+    }
+    // don't forget old data while covariance is large: there's no excitation in
+    // the same direction (e.g. all moves with the same speed), P would grow infinitely
+    double trace = 0., lambda = m->lambda;
+    for(int i = 0; i < RLS_NPAR; ++i) trace += m->P[i][i];
+    if(trace > m->p0 * RLS_NPAR) lambda = 1.;
+    d = lambda;
+    for(int i = 0; i < RLS_NPAR; ++i){
+        Pphi[i] = 0.;
+        for(int j = 0; j < RLS_NPAR; ++j) Pphi[i] += m->P[i][j] * phi[j];
+        d += phi[i] * Pphi[i];
+    }
+    for(int i = 0; i < RLS_NPAR; ++i){
+        k[i] = Pphi[i] / d;
+        m->th[i] += k[i] * e;
+    }
+    // P = (P - k*phi'*P) / lambda, P is symmetric so phi'*P == Pphi'
+    for(int i = 0; i < RLS_NPAR; ++i)
+        for(int j = 0; j < RLS_NPAR; ++j)
+            m->P[i][j] = (m->P[i][j] - k[i] * Pphi[j]) / lambda;
+    m->rms = (m->n == 0) ? fabs(e) : sqrt(0.9*m->rms*m->rms + 0.1*e*e);
+    ++m->n;
+    pthread_mutex_unlock(&m->mtx);
+    return 1;
+}
+
+// coefficient `i` for unscaled x
+double rls_coef(rlsmodel *m, int i){
+    if(i < 0 || i >= RLS_NPAR) return 0.;
+    pthread_mutex_lock(&m->mtx);
+    double c = m->th[i] / pow(m->xscale, i);
+    pthread_mutex_unlock(&m->mtx);
+    return c;
+}
+
+/**
+ * @brief rls_getstate - get model state to store it
+ * @param c (o)   - coefficients for unscaled x
+ * @param P (o)   - covariance (of scaled coefficients)
+ * @param n (o)   - amount of samples
+ * @param rms (o) - RMS of residuals
+ */
+void rls_getstate(rlsmodel *m, double *c, double P[RLS_NPAR][RLS_NPAR], unsigned long *n, double *rms){
+    double s = 1.;
+    pthread_mutex_lock(&m->mtx);
+    for(int i = 0; i < RLS_NPAR; ++i){
+        c[i] = m->th[i] / s;
+        s *= m->xscale;
+        for(int j = 0; j < RLS_NPAR; ++j) P[i][j] = m->P[i][j];
+    }
+    *n = m->n;
+    *rms = m->rms;
+    pthread_mutex_unlock(&m->mtx);
+}
+
+// restore stored state (model should be initialised by rls_init())
+void rls_setstate(rlsmodel *m, const double *c, double P[RLS_NPAR][RLS_NPAR], unsigned long n, double rms){
+    double s = 1.;
+    pthread_mutex_lock(&m->mtx);
+    for(int i = 0; i < RLS_NPAR; ++i){
+        m->th[i] = c[i] * s;
+        s *= m->xscale;
+        for(int j = 0; j < RLS_NPAR; ++j) m->P[i][j] = P[i][j];
+    }
+    m->n = n;
+    m->rms = rms;
+    pthread_mutex_unlock(&m->mtx);
+}
+
+/**
+ * @brief rls_print - print coefficients & residuals
+ * @return amount of symbols printed
+ */
+int rls_print(rlsmodel *m, char *buf, int buflen){
+    double c[RLS_NPAR], s = 1.;
+    pthread_mutex_lock(&m->mtx);
+    for(int i = 0; i < RLS_NPAR; ++i){
+        c[i] = m->th[i] / s;
+        s *= m->xscale;
+    }
+    int l = snprintf(buf, buflen, "%s: c0=%.5g c1=%.5g c2=%.5g n=%lu rejected=%lu lastres=%.1f rms=%.1f\n",
+                     m->name, c[0], c[1], c[2], m->n, m->nrej, m->lastres, m->rms);
+    pthread_mutex_unlock(&m->mtx);
+    return (l < buflen) ? l : buflen - 1;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef RLS_H__
+#define RLS_H__
+
+#include <pthread.h>
+
+// y = c0 + c1*x + c2*x^2
+#define RLS_NPAR        3
+// amount of samples before residuals are used to reject outliers
+#define RLS_MINSAMPLES  (5)
+
+// recursive least squares estimation with exponential forgetting
+typedef struct{
+    const char *name;
+    pthread_mutex_t mtx;
+    double xscale;          // x is divided by it to keep P well-conditioned
+    double lambda;          // forgetting factor (0..1]
+    double p0;              // initial variance (also upper limit for mean variance)
+    double th[RLS_NPAR];    // coefficients for scaled x
+    double P[RLS_NPAR][RLS_NPAR]; // their covariance
+    unsigned long n;        // amount of samples used
+    unsigned long nrej;     // amount of rejected samples
+    double lastres;         // residual of last sample (before update)
+    double rms;             // RMS of residuals (exponentially weighted)
+} rlsmodel;
+
+#define RLSMODEL_INIT(nm)   {.name = nm, .mtx = PTHREAD_MUTEX_INITIALIZER}
+
+void rls_init(rlsmodel *m, const double *c, double xscale, double lambda, double p0);
+double rls_predict(rlsmodel *m, double x);
+int rls_update(rlsmodel *m, double x, double y, double maxres);
+double rls_coef(rlsmodel *m, int i);
+void rls_getstate(rlsmodel *m, double *c, double P[RLS_NPAR][RLS_NPAR], unsigned long *n, double *rms);
+void rls_setstate(rlsmodel *m, const double *c, double P[RLS_NPAR][RLS_NPAR], unsigned long n, double rms);
+int rls_print(rlsmodel *m, char *buf, int buflen);
+
+#endif // RLS_H__
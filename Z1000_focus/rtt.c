@@ -0,0 +1,128 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rtt.h"
+#include <stdio.h>
+
+/**
+ * @brief rtt_add - add measured round-trip time (EWMA like in RFC 6298)
+ * @param r   - statistics
+ * @param rtt - time between request and answer, s
+ */
+void rtt_add(rttstat *r, double rtt){
+    if(rtt < 0.) return;
+    int i = 0;
+    double edge = RTT_BIN0;
+    while(rtt >= edge && i < RTT_NBINS - 1){
+        edge *= 2.;
+        ++i;
+    }
+    pthread_mutex_lock(&r->mtx);
+    if(r->n == 0){
+        r->srtt = r->min = r->max = rtt;
+        r->rttvar = rtt / 2.;
+    }else{
+        double d = r->srtt - rtt;
+        r->rttvar = 0.75 * r->rttvar + 0.25 * (d < 0. ? -d : d);
+        r->srtt = 0.875 * r->srtt + 0.125 * rtt;
+        if(rtt < r->min) r->min = rtt;
+        if(rtt > r->max) r->max = rtt;
+    }
+    ++r->n;
+    ++r->hist[i];
+    r->backoff = 0;
+    pthread_mutex_unlock(&r->mtx);
+}
+
+/**
+ * @brief rtt_lost - register timeout
+ * @param r - statistics
+ */
+void rtt_lost(rttstat *r){
+    pthread_mutex_lock(&r->mtx);
+    ++r->nlost;
+    if(r->backoff < 8) ++r->backoff;
+    pthread_mutex_unlock(&r->mtx);
+}
+
+// percentile without locking
+static double percentile(rttstat *r, double p){
+    if(r->n == 0) return 0.;
+    unsigned long sum = 0, lim = (unsigned long)(p / 100. * r->n);
+    double edge = RTT_BIN0;
+    for(int i = 0; i < RTT_NBINS - 1; ++i, edge *= 2.){
+        sum += r->hist[i];
+        if(sum > lim) return (edge < r->max) ? edge : r->max;
+    }
+    return r->max;
+}
+
+/**
+ * @brief rtt_percentile - estimate percentile of RTT by histogram
+ * @param r - statistics
+ * @param p - percentile (0..100)
+ * @return upper border of histogram bin (or max RTT), s
+ */
+double rtt_percentile(rttstat *r, double p){
+    pthread_mutex_lock(&r->mtx);
+    double v = percentile(r, p);
+    pthread_mutex_unlock(&r->mtx);
+    return v;
+}
+
+/**
+ * @brief rtt_tout - timeout for next request: max(SRTT + 4*RTTVAR, 99th percentile)
+ *          doubled after each timeout in a row
+ * @param r       - statistics
+ * @param maxtout - upper limit (used while there's not enough statistics)
+ * @return timeout, s
+ */
+double rtt_tout(rttstat *r, double maxtout){
+    double t;
+    pthread_mutex_lock(&r->mtx);
+    if(r->n < RTT_MINSAMPLES) t = maxtout;
+    else{
+        t = r->srtt + 4. * r->rttvar;
+        double p = percentile(r, 99.);
+        if(p > t) t = p;
+        for(int i = 0; i < r->backoff; ++i) t *= 2.;
+    }
+    pthread_mutex_unlock(&r->mtx);
+    if(t < RTT_MINTOUT) t = RTT_MINTOUT;
+    if(t > maxtout) t = maxtout;
+    return t;
+}
+
+/**
+ * @brief rtt_print - print statistics (times in ms) & histogram into buf
+ * @param r      - statistics
+ * @param buf    - buffer
+ * @param buflen - its length
+ * @return amount of printed characters
+ */
+int rtt_print(rttstat *r, char *buf, int buflen){
+    int l;
+    pthread_mutex_lock(&r->mtx);
+    l = snprintf(buf, buflen, "%s: n=%lu lost=%lu srtt=%.3f rttvar=%.3f min=%.3f max=%.3f p50=%.3f p99=%.3f hist=",
+                 r->name, r->n, r->nlost, r->srtt*1e3, r->rttvar*1e3, r->min*1e3, r->max*1e3,
+                 percentile(r, 50.)*1e3, percentile(r, 99.)*1e3);
+    for(int i = 0; i < RTT_NBINS && l < buflen; ++i)
+        l += snprintf(buf + l, buflen - l, (i < RTT_NBINS - 1) ? "%lu," : "%lu\n", r->hist[i]);
+    pthread_mutex_unlock(&r->mtx);
+    return (l < buflen) ? l : buflen - 1;
+}
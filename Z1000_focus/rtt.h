@@ -0,0 +1,54 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef RTT_H__
+#define RTT_H__
+
+#include <pthread.h>
+
+// histogram of round-trip times: [0, RTT_BIN0), then each bin is twice wider
+#define RTT_NBINS       16
+#define RTT_BIN0        (50e-6)
+// amount of answers needed to trust statistics
+#define RTT_MINSAMPLES  (8)
+// lower limit of adaptive timeout, s
+#define RTT_MINTOUT     (0.005)
+
+// round-trip time statistics of one device (request -> answer)
+typedef struct{
+    const char *name;
+    pthread_mutex_t mtx;
+    double srtt;            // smoothed RTT, s
+    double rttvar;          // smoothed RTT deviation, s
+    double min, max;        // extremal values, s
+    unsigned long n;        // amount of answers
+    unsigned long nlost;    // amount of timeouts
+    int backoff;            // timeouts in a row (each doubles timeout)
+    unsigned long hist[RTT_NBINS];
+} rttstat;
+
+#define RTTSTAT_INIT(nm)    {.name = nm, .mtx = PTHREAD_MUTEX_INITIALIZER}
+
+void rtt_add(rttstat *r, double rtt);
+void rtt_lost(rttstat *r);
+double rtt_tout(rttstat *r, double maxtout);
+double rtt_percentile(rttstat *r, double p);
+int rtt_print(rttstat *r, char *buf, int buflen);
+
+#endif // RTT_H__
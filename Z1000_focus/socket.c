@@ -22,6 +22,7 @@
  */
 #include "can_encoder.h"
 #include "HW_dependent.h"
+#include "can_io.h"
 #include "usefull_macros.h"
 #include "socket.h"
 #include <netdb.h>      // addrinfo
@@ -233,6 +234,28 @@ static void *handle_socket(void *asock){
         }else if(getparam(S_CMD_LIMITS)){ // send to user limit values
             snprintf(buff, BUFLEN, "focmin=%g\nfocmax=%g\nminspeed=%d\nmaxspeed=%d\n",
                         FOCMIN_MM, FOCMAX_MM, MINSPEED, MAXSPEED);
+        }else if(getparam(S_CMD_CANSTAT)){ // CAN receive statistics
+            unsigned long routed, unrouted, stale, overruns, passed, rejected;
+            can_rx_stats(&routed, &unrouted, &stale, &overruns);
+            // filtered is estimated: interface's rx_packets (sysfs) minus passed to socket
+            can_filter_stats(&passed, &rejected);
+            snprintf(buff, BUFLEN, "routed=%lu\nunrouted=%lu\nstale=%lu\noverruns=%lu\npassed=%lu\nfiltered=%lu\n",
+                        routed, unrouted, stale, overruns, passed, rejected);
+        }else if(getparam(S_CMD_ALARMS)){ // encoder's alarms & emergency
+            encalarms a;
+            get_alarms(&a);
+            snprintf(buff, BUFLEN, "alarms=0x%04x\nwarnings=0x%04x\nemcycode=0x%04x\nerrreg=0x%02x\nnemcy=%lu\n",
+                        a.alarms, a.warnings, a.emcycode, a.errreg, a.nemcy);
+        }else if(getparam(S_CMD_RTT)){ // round-trip times of SDO, PO/PI & parameters
+            print_rtt(buff, BUFLEN);
+        }else if(getparam(S_CMD_CACHE)){ // hits & misses of device values cache
+            print_cache(buff, BUFLEN);
+        }else if(getparam(S_CMD_STOPMODEL)){ // stopping distance coefficients & residuals
+            print_stopmodel(buff, BUFLEN);
+        }else if(getparam(S_CMD_MOVETIMES)){ // learned durations of moves by distance
+            print_movetimes(buff, BUFLEN);
+        }else if(getparam(S_CMD_CURRENT)){ // motor's current & its statistics on last move
+            print_current(buff, BUFLEN);
         }else if(getparam(S_CMD_STOP)){
             DBG("Stop request");
             pthread_mutex_lock(&canbus_mutex);
@@ -288,10 +311,17 @@ static void *handle_socket(void *asock){
                 case STAT_FORBIDDEN:
                     msg = S_STATUS_FORBIDDEN;
                 break;
+                case STAT_ENCERR:
+                    msg = S_STATUS_ENCERR;
+                break;
                 default:
                     msg = "Unknown status";
             }
-            sprintf(buff, "%s", msg);
+            double eta, progress;
+            // while moving add estimated remaining time (s) & done part (0..1)
+            if(ismoving && get_eta(&eta, &progress))
+                snprintf(buff, BUFLEN, "%s\neta=%.1f\nprogress=%.2f", msg, eta, progress);
+            else sprintf(buff, "%s", msg);
         }else sprintf(buff, S_ANS_ERR);
         if(!send_data(sock, webquery, buff)){
             break;
@@ -383,7 +413,7 @@ static void daemon_(int sock){
             getPos(NULL);
             sysstatus st = get_status();
             pthread_mutex_unlock(&canbus_mutex);
-            if(st != STAT_OK){
+            if(st != STAT_OK && st != STAT_ENCERR){
                 getoutESW();
             }
         }
@@ -38,6 +38,13 @@
 #define S_CMD_GOTO      "goto"
 #define S_CMD_STATUS    "status"
 #define S_CMD_LIMITS    "limits"
+#define S_CMD_CANSTAT   "canstat"
+#define S_CMD_ALARMS    "alarms"
+#define S_CMD_RTT       "rtt"
+#define S_CMD_CACHE     "cache"
+#define S_CMD_STOPMODEL "corr"
+#define S_CMD_MOVETIMES "movetimes"
+#define S_CMD_CURRENT   "current"
 
 // answers through the socket
 #define S_ANS_ERR       "error"
@@ -52,6 +59,7 @@
 #define S_STATUS_GOFROMESW  "Wait: moving from end-switch"
 #define S_STATUS_FORBIDDEN  "Error: motion in forbidden position"
 #define S_STATUS_DAMAGE     "Error: damaged state, call engineer"
+#define S_STATUS_ENCERR     "Error: encoder alarm"
 
 //bool emerg_stop;
 
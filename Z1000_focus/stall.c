@@ -0,0 +1,123 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stall.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief stall_init - init detector at start of motion (from standstill)
+ * @param d      - detector
+ * @param accel  - drive's acceleration, counts/s^2
+ * @param lat    - latency of speed command, s
+ * @param window - time of divergence to flag it, s
+ * @param tol    - allowed relative speed deficit (0..1)
+ * @param t0     - start time
+ */
+void stall_init(stalldet *d, double accel, double lat, double window, double tol, double t0){
+    memset(d, 0, sizeof(stalldet));
+    d->accel = accel;
+    d->lat = lat;
+    d->window = window;
+    d->tol = tol;
+    d->tcmd = d->texp = t0;
+    d->tbad = -1.;
+    d->venc = NAN;
+}
+
+/**
+ * @brief stall_command - store commanded speed (called on each cycle, only changes are taken)
+ * @param d    - detector
+ * @param vcmd - speed, counts/s
+ * @param t    - time of command
+ */
+void stall_command(stalldet *d, double vcmd, double t){
+    if(vcmd == d->vcmd) return;
+    d->vprev = (t < d->tcmd + d->lat) ? d->vprev : d->vcmd;
+    d->vcmd = vcmd;
+    d->tcmd = t;
+}
+
+// speed by encoder's samples on last `window` (NAN if they cover less than its half)
+static double encspeed(stalldet *d, int *frozen){
+    int last = (d->head + STALL_NSAMPLES - 1) % STALL_NSAMPLES, first = last;
+    for(int i = 1; i < d->n; ++i){
+        int idx = (last + STALL_NSAMPLES - i) % STALL_NSAMPLES;
+        if(d->t[last] - d->t[idx] > d->window) break;
+        first = idx;
+    }
+    double span = d->t[last] - d->t[first];
+    if(span < d->window / 2.) return NAN;
+    *frozen = (d->pos[last] == d->pos[first]);
+    return (d->pos[last] - d->pos[first]) / span;
+}
+
+/**
+ * @brief stall_check - compare measured speeds with expected by commands & drive's dynamics
+ * @param d    - detector
+ * @param t    - current time
+ * @param pos  - encoder's position along motion direction, counts
+ * @param tpos - its timestamp
+ * @param vmot - motor's speed along motion direction, counts/s (NAN if unknown)
+ * @return kind of divergence lasting more than `window` (STALL_NONE if all OK)
+ */
+stallkind stall_check(stalldet *d, double t, double pos, double tpos, double vmot){
+    // expected speed: acting command reached with drive's acceleration
+    double vt = (t < d->tcmd + d->lat) ? d->vprev : d->vcmd, dv = d->accel * (t - d->texp);
+    if(d->vexp < vt) d->vexp = (d->vexp + dv > vt) ? vt : d->vexp + dv;
+    else d->vexp = (d->vexp - dv < vt) ? vt : d->vexp - dv;
+    d->texp = t;
+    int last = (d->head + STALL_NSAMPLES - 1) % STALL_NSAMPLES;
+    if(d->n == 0 || tpos > d->t[last]){
+        d->t[d->head] = tpos;
+        d->pos[d->head] = pos;
+        d->head = (d->head + 1) % STALL_NSAMPLES;
+        if(d->n < STALL_NSAMPLES) ++d->n;
+        last = (d->head + STALL_NSAMPLES - 1) % STALL_NSAMPLES;
+    }
+    int frozen = 0, stale = (t - d->t[last] > d->window / 2.);
+    d->venc = encspeed(d, &frozen);
+    // measured speeds are averaged or delayed up to `window`
+    double lo = (1. - d->tol) * d->vexp - d->accel * d->window;
+    stallkind k = STALL_NONE;
+    if(lo > 0.){
+        if(!isnan(vmot) && vmot < lo) k = STALL_MOTOR;
+        else if(stale || frozen) k = isnan(vmot) ? STALL_MOTOR : STALL_ENCFREEZE;
+        else if(!isnan(d->venc) && d->venc < lo) k = isnan(vmot) ? STALL_MOTOR : STALL_SLIP;
+    }
+    if(k == STALL_NONE){
+        d->tbad = -1.;
+        return STALL_NONE;
+    }
+    if(d->tbad < 0.) d->tbad = t;
+    d->bad = k;
+    return (t - d->tbad >= d->window) ? k : STALL_NONE;
+}
+
+const char *stall_name(stallkind k){
+    switch(k){
+        case STALL_MOTOR:
+            return "motor stall";
+        case STALL_ENCFREEZE:
+            return "encoder freeze";
+        case STALL_SLIP:
+            return "mechanical slip";
+        default:
+            return "none";
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef STALL_H__
+#define STALL_H__
+
+// size of encoder's samples ring (should cover detection window)
+#define STALL_NSAMPLES  (64)
+
+typedef enum{
+    STALL_NONE = 0,
+    STALL_MOTOR,        // motor doesn't follow commanded speed
+    STALL_ENCFREEZE,    // motor rotates, but encoder's position isn't changing or updated
+    STALL_SLIP,         // motor rotates, mechanism moves slower than it
+} stallkind;
+
+// detector of divergence between commanded & measured speed
+typedef struct{
+    double accel;       // drive's acceleration, counts/s^2
+    double lat;         // latency of commanded speed, s
+    double window;      // time of divergence to flag it (and encoder's speed averaging), s
+    double tol;         // allowed relative speed deficit
+    double vcmd;        // commanded speed, counts/s
+    double vprev;       // previous commanded speed (acting until tcmd + lat)
+    double tcmd;        // time of last command change
+    double vexp;        // expected speed
+    double texp;        // time of its last update
+    double tbad;        // start of divergence (<0 if none)
+    stallkind bad;      // its kind
+    double venc;        // last encoder's speed
+    int n, head;        // encoder's samples ring
+    double t[STALL_NSAMPLES], pos[STALL_NSAMPLES];
+} stalldet;
+
+void stall_init(stalldet *d, double accel, double lat, double window, double tol, double t0);
+void stall_command(stalldet *d, double vcmd, double t);
+stallkind stall_check(stalldet *d, double t, double pos, double tpos, double vmot);
+const char *stall_name(stallkind k);
+
+#endif // STALL_H__
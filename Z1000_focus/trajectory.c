@@ -0,0 +1,152 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trajectory.h"
+#include <math.h>
+
+/**
+ * @brief ramp - times of S-curve speed change by `dv`
+ * @param dv      - speed change, counts/s
+ * @param amax    - max acceleration, counts/s^2
+ * @param jmax    - max jerk, counts/s^3
+ * @param tj (o)  - duration of each of two constant jerk phases
+ * @param ta (o)  - duration of constant acceleration phase
+ */
+static void ramp(double dv, double amax, double jmax, double *tj, double *ta){
+    if(dv <= 0.){
+        *tj = *ta = 0.;
+    }else if(dv * jmax >= amax * amax){ // max acceleration is reached
+        *tj = amax / jmax;
+        *ta = dv / amax - *tj;
+    }else{
+        *tj = sqrt(dv / jmax);
+        *ta = 0.;
+    }
+}
+
+/**
+ * @brief traj_ramptime - duration of S-curve speed change
+ * @param dv   - speed change, counts/s
+ * @param amax - max acceleration, counts/s^2
+ * @param jmax - max jerk, counts/s^3
+ * @return time, s
+ */
+double traj_ramptime(double dv, double amax, double jmax){
+    double tj, ta;
+    ramp(dv, amax, jmax, &tj, &ta);
+    return 2.*tj + ta;
+}
+
+// distance of acceleration from `vmin` to `vpeak` and deceleration back
+static double profdist(double vmin, double vpeak, double amax, double jmax){
+    double tj, ta;
+    ramp(vpeak - vmin, amax, jmax, &tj, &ta);
+    // speed is symmetric around the ramp's middle, so mean speed is (vmin+vpeak)/2
+    return (vmin + vpeak) * (2.*tj + ta);
+}
+
+// add segment of duration `dt` with jerk `j` after the last one
+static void addseg(trajectory *tr, double dt, double j){
+    if(dt <= 0.) return;
+    trajseg *n = &tr->seg[tr->nseg];
+    if(tr->nseg == 0){
+        n->t = n->s = n->a = 0.;
+        n->v = tr->vmin;
+    }else{
+        const trajseg *p = n - 1;
+        double d = tr->T - p->t;
+        n->t = tr->T;
+        n->s = p->s + (p->v + (p->a/2. + p->j*d/6.)*d)*d;
+        n->v = p->v + (p->a + p->j*d/2.)*d;
+        n->a = p->a + p->j*d;
+    }
+    n->j = j;
+    tr->T += dt;
+    ++tr->nseg;
+}
+
+/**
+ * @brief traj_plan - plan time-optimal S-curve profile on given distance
+ * @param tr (o) - trajectory
+ * @param dist   - distance, counts (>= 0)
+ * @param vmin   - start & final speed, counts/s
+ * @param vmax   - max speed, counts/s
+ * @param amax   - max acceleration, counts/s^2
+ * @param jmax   - max jerk, counts/s^3
+ * @return 0 if all OK
+ */
+int traj_plan(trajectory *tr, double dist, double vmin, double vmax, double amax, double jmax){
+    if(!tr || dist < 0. || vmin <= 0. || vmax < vmin || amax <= 0. || jmax <= 0.) return 1;
+    double vpeak = vmax, tj, ta, tc = 0.;
+    if(profdist(vmin, vmax, amax, jmax) <= dist){ // cruise with max speed
+        tc = (dist - profdist(vmin, vmax, amax, jmax)) / vmax;
+    }else{ // profile distance grows with peak speed: find it by bisection
+        double lo = vmin, hi = vmax;
+        for(int i = 0; i < 50; ++i){
+            vpeak = (lo + hi) / 2.;
+            if(profdist(vmin, vpeak, amax, jmax) > dist) hi = vpeak;
+            else lo = vpeak;
+        }
+        vpeak = lo;
+        // the rest of distance (less than bisection error) is passed with peak speed
+        tc = (dist - profdist(vmin, vpeak, amax, jmax)) / vpeak;
+    }
+    ramp(vpeak - vmin, amax, jmax, &tj, &ta);
+    double j = (tj > 0.) ? ((ta > 0.) ? amax / tj : (vpeak - vmin) / (tj*tj)) : 0.;
+    tr->dist = dist;
+    tr->vmin = vmin;
+    tr->vpeak = vpeak;
+    tr->T = 0.;
+    tr->nseg = 0;
+    addseg(tr, tj, j);
+    addseg(tr, ta, 0.);
+    addseg(tr, tj, -j);
+    addseg(tr, tc, 0.);
+    addseg(tr, tj, -j);
+    addseg(tr, ta, 0.);
+    addseg(tr, tj, j);
+    return 0;
+}
+
+/**
+ * @brief traj_eval - planned distance & speed at given time
+ * @param tr    - trajectory
+ * @param t     - time from beginning, s
+ * @param s (o) - distance, counts
+ * @param v (o) - speed, counts/s
+ */
+void traj_eval(const trajectory *tr, double t, double *s, double *v){
+    double ss, vv;
+    if(t <= 0. || tr->nseg == 0){
+        ss = 0.;
+        vv = tr->vmin;
+        if(t > 0.) ss = vv * t;
+    }else if(t >= tr->T){ // crawl after profile's end
+        ss = tr->dist + tr->vmin * (t - tr->T);
+        vv = tr->vmin;
+    }else{
+        int i = tr->nseg - 1;
+        while(i > 0 && tr->seg[i].t > t) --i;
+        const trajseg *g = &tr->seg[i];
+        double d = t - g->t;
+        ss = g->s + (g->v + (g->a/2. + g->j*d/6.)*d)*d;
+        vv = g->v + (g->a + g->j*d/2.)*d;
+    }
+    if(s) *s = ss;
+    if(v) *v = vv;
+}
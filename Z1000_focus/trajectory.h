@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#ifndef TRAJECTORY_H__
+#define TRAJECTORY_H__
+
+// max amount of profile segments: 3 for acceleration, cruise, 3 for deceleration
+#define TRAJ_MAXSEG     7
+
+// segment of profile with constant jerk
+typedef struct{
+    double t;       // start time, s
+    double j;       // jerk, counts/s^3
+    double s;       // distance at start, counts
+    double v;       // speed at start, counts/s
+    double a;       // acceleration at start, counts/s^2
+} trajseg;
+
+// jerk-limited (S-curve) speed profile: from `vmin` to `vpeak` and back to `vmin`
+// on distance `dist`; after its end motion continues with speed `vmin`
+typedef struct{
+    double dist;    // planned distance, counts
+    double vmin;    // start & final speed, counts/s
+    double vpeak;   // max speed reached
+    double T;       // duration, s
+    int nseg;
+    trajseg seg[TRAJ_MAXSEG];
+} trajectory;
+
+int traj_plan(trajectory *tr, double dist, double vmin, double vmax, double amax, double jmax);
+void traj_eval(const trajectory *tr, double t, double *s, double *v);
+double traj_ramptime(double dv, double amax, double jmax);
+
+#endif // TRAJECTORY_H__
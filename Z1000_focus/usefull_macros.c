@@ -449,6 +449,7 @@ static const char *wmsgs[WARN_LAST] = {
     [WARN_GRTRMAX]      = "Forbidden position: > FOCMAX!",
     [WARN_CANSEND]      = "Error sending CAN frame",
     [WARN_CANNOANS]     = "can_send_chk(): error getting answer",
+    [WARN_HBLOST]       = "Encoder's heartbeat lost",
 
 };
 static time_t lasttime[WARN_LAST] = {0};
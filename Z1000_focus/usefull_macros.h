@@ -86,6 +86,7 @@ typedef enum{
     WARN_GRTRMAX,       // curpos > max
     WARN_CANSEND,       // can bus: error sending frame
     WARN_CANNOANS,      // can bus: no answer
+    WARN_HBLOST,        // encoder's heartbeat lost
     WARN_LAST           // N of warnings
 } locwarn;
 // show SINGLEWARN`s not frequently than once per day
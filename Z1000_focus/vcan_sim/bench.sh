@@ -0,0 +1,27 @@
+#!/bin/bash
+# time can_focus motions on simulated CAN bus
+# usage: ./bench.sh [interface] [positions...]
+
+IFACE=${1:-vcan0}
+shift
+POSITIONS=${@:-"10 70 40 3 76 40"}
+FOCUS=$(dirname $0)/../can_focus
+SIM=$(dirname $0)/vcan_sim
+
+if ! ip link show $IFACE >/dev/null 2>&1; then
+	sudo modprobe vcan || exit 1
+	sudo ip link add dev $IFACE type vcan || exit 1
+	sudo ip link set up $IFACE || exit 1
+fi
+
+$SIM -i $IFACE -p 40 &
+SIMPID=$!
+trap "kill $SIMPID" EXIT
+sleep 0.5
+
+for pos in $POSITIONS; do
+	T0=$(date +%s.%N)
+	$FOCUS -A -d $IFACE -g $pos >/dev/null 2>&1 || echo "can_focus failed"
+	T1=$(date +%s.%N)
+	printf "goto %6.2f: %6.3fs\n" $pos $(echo "$T1 - $T0" | bc)
+done
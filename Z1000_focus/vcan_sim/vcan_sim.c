@@ -0,0 +1,691 @@
+/*
+ * This file is part of the Zphocus project.
+ * Copyright 2019 Edward V. Emelianov <edward.emelianoff@gmail.com>.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Simulator of DS406 encoder & SEW motor controller on virtual CAN bus
+
+#include <math.h>
+#include <net/if.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <time.h>
+
+#include "../DS406_canopen.h"
+#include "../canopen.h"
+#include "../HW_dependent.h"
+#include "../motor_cancodes.h"
+#include "../parseargs.h"
+#include "../usefull_macros.h"
+
+// encoder counts per second for one raw motor speed unit
+#define CNTS_PER_RAWSPD     (0.18)
+// motor ramps (raw speed units per second): normal & rapid stop
+#define RAMP_NORMAL         (8000.)
+#define RAMP_RAPID          (32000.)
+// coasting deceleration when output stage is blocked
+#define RAMP_COAST          (3000.)
+// time constant of focuser's mechanics following the motor (s)
+#define LOAD_TAU            (0.05)
+// end-switches positions: behind working zone (mm)
+#define ESW_OFFSET_MM       (0.5)
+// hard mechanical stops behind end-switches (mm)
+#define HARDSTOP_OFFSET_MM  (1.5)
+
+typedef struct{
+    char *iface;            // CAN interface
+    int encnode;            // encoder node ID
+    int motoraddr;          // SEW controller address
+    double startpos;        // starting position, mm
+    int verbose;            // show frames
+} sim_pars;
+
+static sim_pars P = {
+    .iface = "vcan0",
+    .encnode = 3,
+    .motoraddr = 12,
+    .startpos = 40.,
+};
+static int help = 0;
+
+static myoption cmdlnopts[] = {
+    {"help",    NO_ARGS,    NULL,   'h',    arg_none,   APTR(&help),        "show this help"},
+    {"iface",   NEED_ARG,   NULL,   'i',    arg_string, APTR(&P.iface),     "CAN interface (default: vcan0)"},
+    {"node",    NEED_ARG,   NULL,   'n',    arg_int,    APTR(&P.encnode),   "encoder node number (default: 3)"},
+    {"motorid", NEED_ARG,   NULL,   'a',    arg_int,    APTR(&P.motoraddr), "motor controller address (default: 12)"},
+    {"position",NEED_ARG,   NULL,   'p',    arg_double, APTR(&P.startpos),  "starting focus position, mm (default: 40)"},
+    {"verbose", NO_ARGS,    NULL,   'v',    arg_none,   APTR(&P.verbose),   "show all frames"},
+    end_option
+};
+
+static int sock = -1;
+
+/**************** OBJECT DICTIONARY OF ENCODER ****************/
+typedef struct{
+    uint16_t idx;
+    uint8_t subidx;
+    uint8_t len;        // size in bytes
+    uint8_t rw;         // ==1 if writeable
+    uint32_t val;
+} odentry;
+
+static odentry OD[] = {
+    {DS406_DEVTYPE,         0, 4, 0, (2<<16) | 406},
+    {DS406_ERRORREG,        0, 1, 0, 0},
+    {DS406_STORE_PARAMS,    1, 4, 1, 0},
+    {DS406_RESTORE_DEF,     1, 4, 1, 0},
+    {DS406_PROD_HEARTB_TM,  0, 2, 1, 0},
+    {DS406_PDO1,            1, 4, 1, 0x180},
+    {DS406_PDO1,            2, 1, 1, 0xFE},
+    {DS406_PDO1,            5, 2, 1, 0},
+    {DS406_PDO2,            1, 4, 1, 0x280},
+    {DS406_PDO2,            2, 1, 1, 0xFE},
+    {DS406_PDO2,            5, 2, 1, 0},
+    {DS406_PDO1_MAPPED,     0, 1, 1, 1},
+    {DS406_PDO1_MAPPED,     1, 4, 1, DS406_PDO_IS_POSITION},
+    {DS406_PDO2_MAPPED,     0, 1, 1, 0},
+    {DS406_PDO2_MAPPED,     1, 4, 1, DS406_PDO_IS_SPEED},
+    {DS406_CONF_PARAMETERS, 1, 2, 1, 0},
+    {DS406_CONF_PARAMETERS, 2, 4, 1, 0},
+    {DS406_CONF_PARAMETERS, 3, 4, 1, 0xffffffff},
+    {DS406_CONF_VALID,      0, 1, 1, 0},
+    {DS406_POSITION_VAL,    0, 4, 0, 0},
+    {DS406_SPEED_VAL,       1, 2, 0, 0},
+    {DS406_CYCLE_TIMER,     0, 2, 1, 0},
+    {DS406_TURN_RESOLUT,    0, 4, 0, 4096},
+    {DS406_ALARMS,          0, 2, 0, 0},
+    {DS406_WARNINGS,        0, 2, 0, 0},
+    {DS406_SERIAL_NUMBER,   0, 4, 0, 12345},
+};
+#define ODSZ    (sizeof(OD)/sizeof(odentry))
+
+static odentry *od_find(uint16_t idx, uint8_t subidx){
+    for(size_t i = 0; i < ODSZ; ++i)
+        if(OD[i].idx == idx && OD[i].subidx == subidx) return &OD[i];
+    return NULL;
+}
+
+static uint32_t od_get(uint16_t idx, uint8_t subidx){
+    odentry *e = od_find(idx, subidx);
+    return e ? e->val : 0;
+}
+
+/**************** DOMAINS (segmented & block SDO) ****************/
+typedef struct{
+    uint16_t idx;
+    uint8_t subidx;
+    uint8_t rw;         // ==1 if writeable
+    int len;            // current length of data
+    int size;           // size of buffer
+    uint8_t *data;
+} domentry;
+
+static uint8_t devname[] = "vcan_sim DS406 encoder";
+static uint8_t swvers[] = "vcan_sim 1.0";
+static uint8_t custmem[256];
+
+static domentry DOM[] = {
+    {DS406_MANDEVNAME,      0, 0, sizeof(devname) - 1, sizeof(devname) - 1, devname},
+    {DS406_MANSW_VERS,      0, 0, sizeof(swvers) - 1, sizeof(swvers) - 1, swvers},
+    {DS406_CUSTOMER_MEMRY,  0, 1, 0, sizeof(custmem), custmem},
+};
+#define DOMSZ   (sizeof(DOM)/sizeof(domentry))
+
+static domentry *dom_find(uint16_t idx, uint8_t subidx){
+    for(size_t i = 0; i < DOMSZ; ++i)
+        if(DOM[i].idx == idx && DOM[i].subidx == subidx) return &DOM[i];
+    return NULL;
+}
+
+// CRC-16-CCITT for block transfers
+static uint16_t crc16(const uint8_t *buf, int len){
+    uint16_t crc = 0;
+    for(int i = 0; i < len; ++i){
+        crc ^= (uint16_t)buf[i] << 8;
+        for(int b = 0; b < 8; ++b)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/**************** PHYSICAL MODEL ****************/
+typedef struct{
+    double motspd;      // motor speed, raw units
+    double loadspd;     // focuser speed, raw units
+    double pos;         // encoder position, counts
+    double current;     // motor current, 0.1% of nominal
+    int16_t setpoint;   // speed setpoint from PO
+    uint8_t cw;         // control word (low byte)
+    uint32_t di_role_cw, di_role_ccw; // roles of end-switches inputs
+} model;
+
+static model M = {.di_role_cw = DI_ENSTOP, .di_role_ccw = DI_ENSTOP};
+
+static int esw_cw(){  return M.pos >= FOC_MM2RAW(FOCMAX_MM + ESW_OFFSET_MM);}
+static int esw_ccw(){ return M.pos <= FOC_MM2RAW(FOCMIN_MM - ESW_OFFSET_MM);}
+
+// digital inputs state: end-switches are normally closed
+static uint32_t di_state(){
+    uint32_t st = ESW_CW | ESW_CCW | 1; // DI00 - "enable" is always on
+    if(esw_cw()) st &= ~ESW_CW;
+    if(esw_ccw()) st &= ~ESW_CCW;
+    return st;
+}
+
+// make one integration step of `dt` seconds
+static void model_step(double dt){
+    double target = 0., ramp = RAMP_NORMAL;
+    switch(M.cw & 7){
+        case CW_ENABLE:
+            target = M.setpoint;
+        break;
+        case CW_STOP:
+        break;
+        case CW_RAPIDSTOP:
+            ramp = RAMP_RAPID;
+        break;
+        default: // inhibit: coasting
+            ramp = RAMP_COAST;
+    }
+    // "enable/stop" role of end-switch: rapid stop in its direction
+    int dir = MOTOR_REVERSE ? -1 : 1;
+    if((esw_cw() && M.di_role_cw == DI_ENSTOP && target*dir > 0.) ||
+       (esw_ccw() && M.di_role_ccw == DI_ENSTOP && target*dir < 0.)){
+        target = 0.;
+        ramp = RAMP_RAPID;
+    }
+    double dv = target - M.motspd, maxdv = ramp * dt;
+    if(dv > maxdv) dv = maxdv;
+    else if(dv < -maxdv) dv = -maxdv;
+    M.motspd += dv;
+    M.loadspd += (M.motspd - M.loadspd) * dt / LOAD_TAU;
+    M.pos += dir * CNTS_PER_RAWSPD * M.loadspd * dt;
+    // hard stops
+    double hmin = FOC_MM2RAW(FOCMIN_MM - HARDSTOP_OFFSET_MM), hmax = FOC_MM2RAW(FOCMAX_MM + HARDSTOP_OFFSET_MM);
+    if(M.pos < hmin){ M.pos = hmin; M.loadspd = 0.; }
+    else if(M.pos > hmax){ M.pos = hmax; M.loadspd = 0.; }
+    // current: idle + friction + acceleration
+    M.current = 150. + 0.05*fabs(M.motspd) + 0.02*fabs(dv/dt);
+    od_find(DS406_POSITION_VAL, 0)->val = (uint32_t)M.pos;
+    od_find(DS406_SPEED_VAL, 1)->val = (uint16_t)(int16_t)(dir * CNTS_PER_RAWSPD * M.loadspd);
+}
+
+/**************** CAN I/O ****************/
+static void dump(const char *pref, struct can_frame *f){
+    if(!P.verbose) return;
+    printf("%s %03X [%d]", pref, f->can_id & CAN_EFF_MASK, f->len);
+    for(int i = 0; i < f->len; ++i) printf(" %02X", f->data[i]);
+    printf("\n");
+}
+
+static void sendframe(canid_t id, int len, const uint8_t *data){
+    struct can_frame f;
+    memset(&f, 0, sizeof(f));
+    f.can_id = id;
+    f.len = len;
+    if(len) memcpy(f.data, data, len);
+    dump("<<", &f);
+    if(write(sock, &f, sizeof(f)) != sizeof(f)) WARN("write()");
+}
+
+static void opencan(){
+    struct sockaddr_can addr = {0};
+    if((sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) ERR("socket()");
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = if_nametoindex(P.iface);
+    if(!addr.can_ifindex) ERR("if_nametoindex(%s)", P.iface);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ERR("bind()");
+}
+
+/**************** ENCODER ****************/
+static uint8_t nmtstate = NodePreOperational;
+static int toggle = 0, synccount = 0;
+// alarm to set by SIGUSR1 (cleared by SIGUSR2)
+static volatile sig_atomic_t alarmreq = -1;
+
+static void bootup(){
+    uint8_t d = 0;
+    nmtstate = NodePreOperational;
+    toggle = 0;
+    sendframe(0x700 + P.encnode, 1, &d);
+}
+
+// pack mapped objects of PDO n (0 or 1) and send it
+static void send_pdo(int n){
+    uint8_t data[8] = {0};
+    int nmapped = od_get(DS406_PDO1_MAPPED + n, 0), len = 0;
+    for(int i = 1; i <= nmapped && len < 8; ++i){
+        uint32_t m = od_get(DS406_PDO1_MAPPED + n, i);
+        int bytes = (m & 0xff) / 8;
+        uint32_t v = od_get(m >> 16, (m >> 8) & 0xff);
+        for(int b = 0; b < bytes && len < 8; ++b, v >>= 8) data[len++] = v & 0xff;
+    }
+    if(len) sendframe((od_get(DS406_PDO1 + n, 1) & 0x7ff) + P.encnode, len, data);
+}
+
+static void sdo_abort(uint16_t idx, uint8_t sub, uint32_t code){
+    uint8_t d[8] = {0x80, idx & 0xff, idx >> 8, sub, code & 0xff, (code>>8) & 0xff, (code>>16) & 0xff, code >> 24};
+    sendframe(0x580 + P.encnode, 8, d);
+}
+
+// current segmented or block transfer
+typedef enum{
+    XFER_NONE = 0,
+    XFER_SEGUP,         // segmented upload
+    XFER_SEGDN,         // segmented download
+    XFER_BLKUP_INIT,    // block upload: waiting for start
+    XFER_BLKUP,         // block upload: waiting for sub-block acknowledge
+    XFER_BLKUP_END,     // block upload: waiting for end confirmation
+    XFER_BLKDN,         // block download: receiving segments
+    XFER_BLKDN_END      // block download: waiting for end frame
+} xfer_mode;
+
+static struct{
+    xfer_mode mode;
+    domentry *d;
+    int pos;            // position in data
+    int start;          // position of current sub-block beginning
+    int toggle;
+    int blksize;
+    int seq;            // last good sequence number in block download
+    int crc;            // CRC supported by client
+} xfer;
+
+static void sdo_send(uint8_t *ans){
+    sendframe(0x580 + P.encnode, 8, ans);
+}
+
+// send sub-block of block upload
+static void blkup_send(){
+    uint8_t d[8];
+    xfer.start = xfer.pos;
+    for(int seq = 1; seq <= xfer.blksize && xfer.pos < xfer.d->len; ++seq){
+        int n = xfer.d->len - xfer.pos;
+        if(n > 7) n = 7;
+        memset(d, 0, 8);
+        memcpy(&d[1], xfer.d->data + xfer.pos, n);
+        xfer.pos += n;
+        d[0] = seq | ((xfer.pos == xfer.d->len) ? 0x80 : 0);
+        sdo_send(d);
+    }
+    xfer.mode = XFER_BLKUP;
+}
+
+// continue segmented or block transfer; return 0 if frame isn't a part of it
+static int encoder_xfer(struct can_frame *f){
+    uint8_t cmd = f->data[0], ans[8] = {0};
+    domentry *d = xfer.d;
+    int n;
+    switch(xfer.mode){
+        case XFER_SEGUP:
+            if((cmd & 0xef) != 0x60) return 0;
+            if((cmd & 0x10) != xfer.toggle){
+                sdo_abort(d->idx, d->subidx, 0x05030000);
+                break;
+            }
+            n = d->len - xfer.pos;
+            if(n > 7) n = 7;
+            memcpy(&ans[1], d->data + xfer.pos, n);
+            xfer.pos += n;
+            ans[0] = xfer.toggle | ((7 - n) << 1) | ((xfer.pos == d->len) ? 1 : 0);
+            sdo_send(ans);
+            xfer.toggle ^= 0x10;
+            if(xfer.pos < d->len) return 1;
+            break;
+        case XFER_SEGDN:
+            if((cmd & 0xe0) != 0) return 0;
+            if((cmd & 0x10) != xfer.toggle){
+                sdo_abort(d->idx, d->subidx, 0x05030000);
+                break;
+            }
+            n = 7 - ((cmd >> 1) & 7);
+            if(xfer.pos + n > d->size){
+                sdo_abort(d->idx, d->subidx, 0x06070012); // too long
+                break;
+            }
+            memcpy(d->data + xfer.pos, &f->data[1], n);
+            xfer.pos += n;
+            ans[0] = 0x20 | xfer.toggle;
+            sdo_send(ans);
+            xfer.toggle ^= 0x10;
+            if(!(cmd & 1)) return 1;
+            d->len = xfer.pos;
+            break;
+        case XFER_BLKUP_INIT:
+            if(cmd != 0xA3) return 0;
+            blkup_send();
+            return 1;
+        case XFER_BLKUP:
+            if(cmd != 0xA2) return 0;
+            xfer.pos = xfer.start + f->data[1] * 7;
+            if(xfer.pos > d->len) xfer.pos = d->len;
+            xfer.blksize = f->data[2];
+            if(xfer.blksize < 1 || xfer.blksize > 127){
+                sdo_abort(d->idx, d->subidx, 0x05040002);
+                break;
+            }
+            if(xfer.pos < d->len){
+                blkup_send();
+                return 1;
+            }
+            n = d->len % 7;
+            uint16_t crc = crc16(d->data, d->len);
+            ans[0] = 0xC1 | ((n ? 7 - n : 0) << 2);
+            ans[1] = crc & 0xff; ans[2] = crc >> 8;
+            sdo_send(ans);
+            xfer.mode = XFER_BLKUP_END;
+            return 1;
+        case XFER_BLKUP_END:
+            if(cmd != 0xA1) return 0;
+            break;
+        case XFER_BLKDN:
+            n = cmd & 0x7f;
+            if(n != xfer.seq + 1){
+                sdo_abort(d->idx, d->subidx, 0x05040003); // invalid sequence number
+                break;
+            }
+            if(xfer.pos >= d->size){ // too long
+                sdo_abort(d->idx, d->subidx, 0x06070012);
+                break;
+            }
+            n = d->size - xfer.pos;
+            if(n > 7) n = 7;
+            memcpy(d->data + xfer.pos, &f->data[1], n);
+            xfer.pos += 7;
+            ++xfer.seq;
+            if(xfer.seq == xfer.blksize || (cmd & 0x80)){
+                ans[0] = 0xA2; ans[1] = xfer.seq; ans[2] = xfer.blksize;
+                sdo_send(ans);
+                xfer.seq = 0;
+                if(cmd & 0x80) xfer.mode = XFER_BLKDN_END;
+            }
+            return 1;
+        case XFER_BLKDN_END:
+            if((cmd & 0xe3) != 0xC1) return 0;
+            n = xfer.pos - ((cmd >> 2) & 7);
+            if(n > d->size) n = d->size;
+            if(xfer.crc && crc16(d->data, n) != (f->data[1] | (f->data[2] << 8))){
+                sdo_abort(d->idx, d->subidx, 0x05040004); // CRC error
+                break;
+            }
+            d->len = n;
+            ans[0] = 0xA1;
+            sdo_send(ans);
+            break;
+        default:
+            return 0;
+    }
+    xfer.mode = XFER_NONE;
+    return 1;
+}
+
+// initiate transfer of domain object
+static void domain_sdo(struct can_frame *f, domentry *d){
+    uint8_t cmd = f->data[0], ans[8] = {0, f->data[1], f->data[2], f->data[3]};
+    xfer.d = d;
+    xfer.pos = 0;
+    xfer.toggle = 0;
+    if(cmd == 0x40){ // upload: expedited if short
+        if(d->len <= 4){
+            ans[0] = 0x43 | ((4 - d->len) << 2);
+            memcpy(&ans[4], d->data, d->len);
+        }else{
+            ans[0] = 0x41;
+            ans[4] = d->len & 0xff; ans[5] = d->len >> 8;
+            xfer.mode = XFER_SEGUP;
+        }
+    }else if((cmd & 0xe3) == 0xA0){ // block upload
+        xfer.blksize = f->data[4];
+        if(xfer.blksize < 1 || xfer.blksize > 127){
+            sdo_abort(d->idx, d->subidx, 0x05040002);
+            return;
+        }
+        xfer.crc = cmd & 4;
+        ans[0] = 0xC6; // CRC supported, size indicated
+        ans[4] = d->len & 0xff; ans[5] = d->len >> 8;
+        xfer.mode = XFER_BLKUP_INIT;
+    }else if(!d->rw && ((cmd & 0xe0) == 0x20 || (cmd & 0xf9) == 0xC0)){
+        sdo_abort(d->idx, d->subidx, 0x06010002); // read only
+        return;
+    }else if((cmd & 0xe0) == 0x20){ // download
+        if(cmd & 2){ // expedited
+            int n = (cmd & 1) ? 4 - ((cmd >> 2) & 3) : 4;
+            memcpy(d->data, &f->data[4], n);
+            d->len = n;
+        }else xfer.mode = XFER_SEGDN;
+        ans[0] = 0x60;
+    }else if((cmd & 0xf9) == 0xC0){ // block download
+        xfer.crc = cmd & 4;
+        xfer.seq = 0;
+        xfer.blksize = 32;
+        ans[0] = 0xA4; // CRC supported
+        ans[4] = xfer.blksize;
+        xfer.mode = XFER_BLKDN;
+    }else{
+        sdo_abort(d->idx, d->subidx, 0x05040001); // wrong command
+        return;
+    }
+    sdo_send(ans);
+}
+
+static void encoder_sdo(struct can_frame *f){
+    uint8_t cmd = f->data[0], sub = f->data[3];
+    uint16_t idx = f->data[1] | (f->data[2] << 8);
+    uint8_t ans[8] = {0, f->data[1], f->data[2], sub};
+    if(cmd == 0x80){ // client aborts transfer
+        xfer.mode = XFER_NONE;
+        return;
+    }
+    if(xfer.mode != XFER_NONE){
+        if(encoder_xfer(f)) return;
+        xfer.mode = XFER_NONE; // new request breaks previous transfer
+    }
+    domentry *d = dom_find(idx, sub);
+    if(d){
+        domain_sdo(f, d);
+        return;
+    }
+    odentry *e = od_find(idx, sub);
+    if(!e){
+        sdo_abort(idx, sub, 0x06020000); // object doesn't exist
+        return;
+    }
+    if(cmd == 0x40){ // upload
+        ans[0] = 0x43 | ((4 - e->len) << 2);
+        uint32_t v = e->val;
+        for(int i = 0; i < e->len; ++i, v >>= 8) ans[4+i] = v & 0xff;
+    }else if((cmd & 0xe0) == 0x20){ // expedited download
+        if(!e->rw){
+            sdo_abort(idx, sub, 0x06010002); // read only
+            return;
+        }
+        int n = (cmd & 1) ? 4 - ((cmd >> 2) & 3) : 4;
+        uint32_t v = 0;
+        for(int i = n-1; i >= 0; --i) v = (v << 8) | f->data[4+i];
+        e->val = v;
+        ans[0] = 0x60;
+    }else{
+        sdo_abort(idx, sub, 0x05040001); // wrong command
+        return;
+    }
+    sdo_send(ans);
+}
+
+static void encoder_frame(struct can_frame *f){
+    canid_t id = f->can_id & CAN_EFF_MASK;
+    int node = P.encnode;
+    if(f->can_id & CAN_RTR_FLAG){
+        if(id == 0x700u + node){ // node guarding
+            uint8_t d = nmtstate | (toggle ? 0x80 : 0);
+            toggle = !toggle;
+            sendframe(0x700 + node, 1, &d);
+        }else if(id == 0x180u + node && nmtstate == NodeOperational) send_pdo(0);
+        else if(id == 0x280u + node && nmtstate == NodeOperational) send_pdo(1);
+        return;
+    }
+    if(id == 0 && f->len == 2 && (f->data[1] == 0 || f->data[1] == node)){ // NMT
+        switch(f->data[0]){
+            case 1: nmtstate = NodeOperational; break;
+            case 2: nmtstate = NodeStopped; break;
+            case 0x80: nmtstate = NodePreOperational; break;
+            case 0x81:
+            case 0x82: bootup(); break;
+        }
+    }else if(id == 0x80){ // SYNC
+        ++synccount;
+        if(nmtstate != NodeOperational) return;
+        for(int n = 0; n < 2; ++n){
+            uint32_t tt = od_get(DS406_PDO1 + n, 2);
+            if(tt >= 1 && tt <= 240 && synccount % tt == 0) send_pdo(n);
+        }
+    }else if(id == 0x600u + node && f->len == 8 && nmtstate != NodeStopped) encoder_sdo(f);
+}
+
+// send EMCY with alarm or error reset
+static void encoder_alarm(int on){
+    uint8_t d[8] = {0};
+    od_find(DS406_ALARMS, 0)->val = on ? 1 : 0; // position error
+    od_find(DS406_ERRORREG, 0)->val = on ? 0x80 : 0;
+    if(on){ d[0] = 0x00; d[1] = 0xFF; d[2] = 0x80; }
+    sendframe(0x80 + P.encnode, 8, d);
+}
+
+static void alarmsig(int sig){
+    alarmreq = (sig == SIGUSR1);
+}
+
+// cyclic PDOs & heartbeat
+static void encoder_timers(double t){
+    static double tpdo = 0., thb = 0.;
+    uint32_t cyc = od_get(DS406_CYCLE_TIMER, 0), hb = od_get(DS406_PROD_HEARTB_TM, 0);
+    if(cyc && nmtstate == NodeOperational && t - tpdo >= cyc * 1e-3){
+        tpdo = t;
+        for(int n = 0; n < 2; ++n){
+            uint32_t tt = od_get(DS406_PDO1 + n, 2);
+            if(tt >= 0xFE) send_pdo(n);
+        }
+    }
+    if(hb && t - thb >= hb * 1e-3){
+        thb = t;
+        sendframe(0x700 + P.encnode, 1, &nmtstate);
+    }
+}
+
+/**************** SEW CONTROLLER ****************/
+static void motor_po(struct can_frame *f){
+    M.cw = f->data[1];
+    M.setpoint = (int16_t)((f->data[2] << 8) | f->data[3]);
+    // process input data: status word, actual speed, current
+    int16_t spd = (int16_t)M.motspd;
+    uint16_t crnt = (uint16_t)M.current;
+    uint8_t st = SW_B_READY | SW_B_POUNBLOCK;
+    if((M.cw & 7) == CW_ENABLE) st |= SW_B_UNBLOCK;
+    uint8_t pi[6] = {st, ((M.cw & 7) == CW_ENABLE) ? STATE_REGUL : STATE_NOPERMIT,
+                     spd >> 8, spd & 0xff, crnt >> 8, crnt & 0xff};
+    sendframe(MOTOR_PO_ID(P.motoraddr) + 1, 6, pi);
+}
+
+static void motor_param(struct can_frame *f){
+    uint8_t ans[8];
+    memcpy(ans, f->data, 8);
+    uint16_t idx = (f->data[2] << 8) | f->data[3];
+    uint32_t val = (f->data[4] << 24) | (f->data[5] << 16) | (f->data[6] << 8) | f->data[7];
+    uint32_t *rw = NULL, ro = 0;
+    int found = 1;
+    switch(idx){
+        case PAR_SPD_IDX: // rev/min * 1000
+            ro = (uint32_t)(int32_t)(REVMIN(M.motspd) * 1000.);
+        break;
+        case PAR_CRNT_IDX:
+            ro = (uint32_t)M.current;
+        break;
+        case PAR_DIST_IDX:
+            ro = di_state();
+        break;
+        case PAR_CW_IDX:
+            rw = &M.di_role_cw;
+        break;
+        case PAR_CCW_IDX:
+            rw = &M.di_role_ccw;
+        break;
+        default:
+            found = 0;
+    }
+    if(!found) ans[0] |= CAN_PAR_ERRFLAG;
+    else if(f->data[0] == CAN_WRITEPAR_CMD){
+        if(rw) *rw = val;
+        else ans[0] |= CAN_PAR_ERRFLAG;
+    }else{
+        if(rw) ro = *rw;
+        ans[4] = ro >> 24; ans[5] = (ro >> 16) & 0xff; ans[6] = (ro >> 8) & 0xff; ans[7] = ro & 0xff;
+    }
+    sendframe(MOTOR_PAR_ID(P.motoraddr) + 1, 8, ans);
+}
+
+/**************** MAIN ****************/
+static double mono(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void signals(int sig){
+    if(sock > -1) close(sock);
+    exit(sig);
+}
+
+int main(int argc, char **argv){
+    initial_setup();
+    change_helpstring("Usage: %s [args]\n\tSimulator of DS406 encoder & SEW controller\n\n\tWhere args are:\n");
+    parseargs(&argc, &argv, cmdlnopts);
+    if(help) showhelp(-1, cmdlnopts);
+    signal(SIGINT, signals);
+    signal(SIGTERM, signals);
+    signal(SIGUSR1, alarmsig);
+    signal(SIGUSR2, alarmsig);
+    M.pos = FOC_MM2RAW(P.startpos);
+    model_step(1e-3);
+    opencan();
+    bootup();
+    green("Simulate encoder (node %d) & motor (address %d) on %s\n", P.encnode, P.motoraddr, P.iface);
+    double tlast = mono();
+    canid_t po = MOTOR_PO_ID(P.motoraddr), par = MOTOR_PAR_ID(P.motoraddr);
+    while(1){
+        struct pollfd pfd = {.fd = sock, .events = POLLIN};
+        int n = poll(&pfd, 1, 1);
+        double t = mono();
+        for(; tlast + 1e-3 <= t; tlast += 1e-3) model_step(1e-3);
+        encoder_timers(t);
+        if(alarmreq > -1){
+            encoder_alarm(alarmreq);
+            alarmreq = -1;
+        }
+        if(n < 1) continue;
+        struct can_frame f;
+        if(read(sock, &f, sizeof(f)) != sizeof(f)) continue;
+        dump(">>", &f);
+        canid_t id = f.can_id & CAN_EFF_MASK;
+        if(f.can_id & CAN_EFF_FLAG) continue;
+        if(!(f.can_id & CAN_RTR_FLAG) && id == po && f.len >= 4) motor_po(&f);
+        else if(!(f.can_id & CAN_RTR_FLAG) && id == par && f.len == 8) motor_param(&f);
+        else encoder_frame(&f);
+    }
+    return 0;
+}